@@ -0,0 +1,519 @@
+#include "common.h"
+
+#include <time.h>
+#include <sched.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+// Runs multithreaded workloads against glibc's malloc, pmem with profiling
+// disabled and pmem with profiling enabled:
+//
+//   bench_alloc [libpmem.so [workload]]
+//
+// Each run is done in a fresh process which re-executes this binary with the
+// allocator preloaded so that the peak RSS isn't shared between runs. Results
+// are printed as one JSON object per line. Latencies are measured on one call
+// out of sample_rate and include the cost of reading the clock. Along with the
+// RSS, the bytes held in pmem's vma cache are reported at their peak and once
+// the workload's threads are done.
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+enum
+{
+    threads = 4,
+    sample_rate = 16,
+    sample_cap = 1 << 18,
+};
+
+
+// -----------------------------------------------------------------------------
+// ctx
+// -----------------------------------------------------------------------------
+
+struct ctx
+{
+    uint64_t rng;
+    size_t ops;
+    size_t samples_len;
+    uint64_t samples[sample_cap];
+};
+
+static struct ctx ctxs[threads];
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline uint64_t rng(struct ctx *ctx)
+{
+    // xorshift64
+    ctx->rng ^= ctx->rng << 13;
+    ctx->rng ^= ctx->rng >> 7;
+    ctx->rng ^= ctx->rng << 17;
+    return ctx->rng;
+}
+
+static inline size_t rng_len(struct ctx *ctx, size_t min, size_t max)
+{
+    return min + rng(ctx) % (max - min + 1);
+}
+
+static inline uint64_t op_begin(struct ctx *ctx)
+{
+    if (ctx->ops++ % sample_rate || ctx->samples_len == sample_cap) return 0;
+    return now_ns();
+}
+
+static inline void op_end(struct ctx *ctx, uint64_t start)
+{
+    if (start) ctx->samples[ctx->samples_len++] = now_ns() - start;
+}
+
+// Writes to the block so that the allocation can't be elided and the pages are
+// actually faulted in.
+static inline void *touch(void *ptr, size_t len)
+{
+    if (!ptr) abort();
+    ((volatile uint8_t *) ptr)[0] = 1;
+    ((volatile uint8_t *) ptr)[len - 1] = 1;
+    return ptr;
+}
+
+static void *bench_malloc(struct ctx *ctx, size_t len)
+{
+    uint64_t start = op_begin(ctx);
+    void *ptr = malloc(len);
+    op_end(ctx, start);
+    return touch(ptr, len);
+}
+
+static void *bench_realloc(struct ctx *ctx, void *ptr, size_t len)
+{
+    uint64_t start = op_begin(ctx);
+    ptr = realloc(ptr, len);
+    op_end(ctx, start);
+    return touch(ptr, len);
+}
+
+static void bench_free(struct ctx *ctx, void *ptr)
+{
+    uint64_t start = op_begin(ctx);
+    free(ptr);
+    op_end(ctx, start);
+}
+
+
+// -----------------------------------------------------------------------------
+// larson
+// -----------------------------------------------------------------------------
+
+// Threads replace random blocks of a heap and hand it over to the next thread
+// after every round which frees the blocks allocated by the previous owner.
+
+enum { larson_slots = 1024, larson_rounds = 64, larson_iters = 16 * 1024 };
+
+static void *larson_heaps[threads][larson_slots];
+static pthread_barrier_t larson_barrier;
+
+static void larson_setup(void)
+{
+    pthread_barrier_init(&larson_barrier, NULL, threads);
+}
+
+static void run_larson(struct ctx *ctx, size_t id)
+{
+    for (size_t round = 0; round < larson_rounds; ++round) {
+        void **heap = larson_heaps[(id + round) % threads];
+
+        for (size_t i = 0; i < larson_iters; ++i) {
+            void **slot = &heap[rng(ctx) % larson_slots];
+            if (*slot) bench_free(ctx, *slot);
+            *slot = bench_malloc(ctx, rng_len(ctx, 16, 512));
+        }
+
+        pthread_barrier_wait(&larson_barrier);
+    }
+}
+
+static void larson_teardown(void)
+{
+    for (size_t i = 0; i < threads; ++i)
+        for (size_t j = 0; j < larson_slots; ++j)
+            free(larson_heaps[i][j]);
+    pthread_barrier_destroy(&larson_barrier);
+}
+
+
+// -----------------------------------------------------------------------------
+// prodcons
+// -----------------------------------------------------------------------------
+
+// Pairs of threads where the producer allocates and the consumer frees through
+// a bounded single-producer single-consumer queue.
+
+enum { queue_cap = 256, prodcons_items = 1 << 20 };
+
+struct queue
+{
+    atomic_size_t head __attribute__((aligned(64)));
+    atomic_size_t tail __attribute__((aligned(64)));
+    void *items[queue_cap];
+};
+
+static struct queue queues[threads / 2];
+
+static void run_producer(struct ctx *ctx, struct queue *queue)
+{
+    for (size_t i = 0; i < prodcons_items; ++i) {
+        void *ptr = bench_malloc(ctx, rng_len(ctx, 16, 1024));
+
+        size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+        while (head - atomic_load_explicit(&queue->tail, memory_order_acquire) == queue_cap)
+            sched_yield();
+
+        queue->items[head % queue_cap] = ptr;
+        atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    }
+}
+
+static void run_consumer(struct ctx *ctx, struct queue *queue)
+{
+    for (size_t i = 0; i < prodcons_items; ++i) {
+        size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+        while (atomic_load_explicit(&queue->head, memory_order_acquire) == tail)
+            sched_yield();
+
+        void *ptr = queue->items[tail % queue_cap];
+        atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+        bench_free(ctx, ptr);
+    }
+}
+
+static void run_prodcons(struct ctx *ctx, size_t id)
+{
+    if (id % 2) run_consumer(ctx, &queues[id / 2]);
+    else run_producer(ctx, &queues[id / 2]);
+}
+
+
+// -----------------------------------------------------------------------------
+// realloc
+// -----------------------------------------------------------------------------
+
+// Buffers grown by 1.5x from a few bytes up to realloc_max.
+
+enum { realloc_rounds = 16 * 1024, realloc_max = 64 * 1024 };
+
+static void run_realloc(struct ctx *ctx, size_t id)
+{
+    (void) id;
+
+    for (size_t round = 0; round < realloc_rounds; ++round) {
+        void *ptr = NULL;
+        for (size_t len = 16; len <= realloc_max; len += len / 2 + rng_len(ctx, 0, 16))
+            ptr = bench_realloc(ctx, ptr, len);
+        bench_free(ctx, ptr);
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// mixed
+// -----------------------------------------------------------------------------
+
+// Random replacements within a heap where 80% of the blocks are up to 128
+// bytes, 15% up to 4Kb and 5% up to 256Kb which includes vma allocations.
+
+enum { mixed_slots = 4 * 1024, mixed_iters = 512 * 1024 };
+
+static void *mixed_heaps[threads][mixed_slots];
+
+static size_t mixed_len(struct ctx *ctx)
+{
+    size_t pick = rng(ctx) % 100;
+    if (pick < 80) return rng_len(ctx, 16, 128);
+    if (pick < 95) return rng_len(ctx, 129, 4096);
+    return rng_len(ctx, 4097, 256 * 1024);
+}
+
+static void run_mixed(struct ctx *ctx, size_t id)
+{
+    void **heap = mixed_heaps[id];
+
+    for (size_t i = 0; i < mixed_iters; ++i) {
+        void **slot = &heap[rng(ctx) % mixed_slots];
+        if (*slot) bench_free(ctx, *slot);
+        *slot = bench_malloc(ctx, mixed_len(ctx));
+    }
+
+    for (size_t i = 0; i < mixed_slots; ++i) {
+        if (heap[i]) bench_free(ctx, heap[i]);
+        heap[i] = NULL;
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// longlived
+// -----------------------------------------------------------------------------
+
+// A long-lived heap built up front and freed at the end with short-lived
+// allocations churning in between.
+
+enum
+{
+    longlived_bytes = 32 << 20,
+    longlived_cap = 64 * 1024,
+    churn_window = 16,
+    churn_iters = 1 << 20,
+};
+
+static void *longlived_heaps[threads][longlived_cap];
+
+static void run_longlived(struct ctx *ctx, size_t id)
+{
+    void **heap = longlived_heaps[id];
+
+    size_t len = 0;
+    for (size_t bytes = 0; bytes < longlived_bytes / threads && len < longlived_cap; ++len) {
+        size_t block = rng_len(ctx, 64, 4096);
+        heap[len] = bench_malloc(ctx, block);
+        bytes += block;
+    }
+
+    void *window[churn_window] = {0};
+    for (size_t i = 0; i < churn_iters; ++i) {
+        void **slot = &window[i % churn_window];
+        if (*slot) bench_free(ctx, *slot);
+        *slot = bench_malloc(ctx, rng_len(ctx, 16, 256));
+    }
+
+    for (size_t i = 0; i < churn_window; ++i) bench_free(ctx, window[i]);
+    for (size_t i = 0; i < len; ++i) bench_free(ctx, heap[i]);
+}
+
+
+// -----------------------------------------------------------------------------
+// workloads
+// -----------------------------------------------------------------------------
+
+struct workload
+{
+    const char *name;
+    void (*setup) (void);
+    void (*run) (struct ctx *, size_t id);
+    void (*teardown) (void);
+};
+
+static const struct workload workloads[] = {
+    { .name = "larson", .setup = larson_setup, .run = run_larson, .teardown = larson_teardown },
+    { .name = "prodcons", .run = run_prodcons },
+    { .name = "realloc", .run = run_realloc },
+    { .name = "mixed", .run = run_mixed },
+    { .name = "longlived", .run = run_longlived },
+};
+
+static const struct workload *workload_find(const char *name)
+{
+    for (size_t i = 0; i < sizeof_arr(workloads); ++i)
+        if (!strcmp(workloads[i].name, name)) return &workloads[i];
+    return NULL;
+}
+
+static const struct workload *workload_current = NULL;
+
+static atomic_size_t workload_done = 0;
+
+static void *workload_thread(void *arg)
+{
+    size_t id = (uintptr_t) arg;
+    workload_current->run(&ctxs[id], id);
+    atomic_fetch_add(&workload_done, 1);
+    return NULL;
+}
+
+// Freed large allocations sit in pmem's vma cache until they decay and their
+// touched pages count towards the RSS while they do. The cache is sampled while
+// the workload runs so its peak can be put against the peak RSS.
+enum { cached_sample_us = 10 * 1000 };
+
+static size_t cached_kb(void)
+{
+    struct pmem_stats stats = {0};
+    if (pmem_stats) pmem_stats(&stats);
+    return stats.vma_cached / 1024;
+}
+
+// Current resident set size which, unlike the peak reported by getrusage, can
+// be compared with the bytes pmem holds in its vma cache at the same point.
+static size_t rss_kb(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+
+    size_t pages = 0, resident = 0;
+    if (fscanf(file, "%zu %zu", &pages, &resident) != 2) resident = 0;
+    fclose(file);
+
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int cmp_u64(const void *lhs, const void *rhs)
+{
+    uint64_t a = *(const uint64_t *) lhs, b = *(const uint64_t *) rhs;
+    return a < b ? -1 : a > b;
+}
+
+static int workload_exec(const char *alloc, const struct workload *workload)
+{
+    workload_current = workload;
+    for (size_t i = 0; i < threads; ++i)
+        ctxs[i] = (struct ctx) { .rng = 0x9e3779b97f4a7c15 * (i + 1) };
+
+    if (workload->setup) workload->setup();
+
+    pthread_t th[threads];
+    uint64_t start = now_ns();
+
+    workload_done = 0;
+    for (size_t i = 0; i < threads; ++i)
+        pthread_create(&th[i], NULL, workload_thread, (void *) i);
+
+    size_t cached_peak = 0;
+    while (pmem_stats && atomic_load(&workload_done) < threads) {
+        size_t cached = cached_kb();
+        if (cached > cached_peak) cached_peak = cached;
+        usleep(cached_sample_us);
+    }
+
+    for (size_t i = 0; i < threads; ++i)
+        pthread_join(th[i], NULL);
+
+    uint64_t elapsed = now_ns() - start;
+    size_t cached = cached_kb();
+    size_t rss = rss_kb();
+
+    if (workload->teardown) workload->teardown();
+
+    size_t ops = 0, samples_len = 0;
+    for (size_t i = 0; i < threads; ++i) {
+        ops += ctxs[i].ops;
+        samples_len += ctxs[i].samples_len;
+    }
+
+    uint64_t *samples = calloc(samples_len + 1, sizeof(*samples));
+    for (size_t i = 0, len = 0; i < threads; ++i) {
+        memcpy(samples + len, ctxs[i].samples, ctxs[i].samples_len * sizeof(*samples));
+        len += ctxs[i].samples_len;
+    }
+    qsort(samples, samples_len, sizeof(*samples), cmp_u64);
+
+    struct rusage usage = {0};
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("{\"workload\":\"%s\",\"alloc\":\"%s\",\"threads\":%d,"
+            "\"ops\":%zu,\"ops_per_sec\":%.0f,"
+            "\"p50_ns\":%lu,\"p99_ns\":%lu,\"peak_rss_kb\":%ld,"
+            "\"peak_cached_kb\":%zu,\"rss_kb\":%zu,\"cached_kb\":%zu}\n",
+            workload->name, alloc, threads,
+            ops, ops / (elapsed / 1e9),
+            samples[samples_len / 2], samples[samples_len * 99 / 100],
+            usage.ru_maxrss, cached > cached_peak ? cached : cached_peak, rss, cached);
+
+    free(samples);
+    return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// allocs
+// -----------------------------------------------------------------------------
+
+struct alloc
+{
+    const char *name;
+    bool preload;
+    const char *profile;
+};
+
+static const struct alloc allocs[] = {
+    { .name = "glibc", .preload = false },
+    { .name = "pmem", .preload = true, .profile = "0" },
+    { .name = "pmem-prof", .preload = true, .profile = "1" },
+};
+
+static bool alloc_spawn(const struct alloc *alloc, const char *lib, const struct workload *workload)
+{
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == -1) { perror("fork"); return false; }
+
+    if (!pid) {
+        if (alloc->preload) {
+            setenv("LD_PRELOAD", lib, 1);
+            setenv("PMEM_PROFILE", alloc->profile, 1);
+        }
+        else unsetenv("LD_PRELOAD");
+
+        char *argv[] = {
+            (char *) "bench_alloc", (char *) "--run",
+            (char *) alloc->name, (char *) workload->name, NULL };
+        execv("/proc/self/exe", argv);
+        perror("execv");
+        _exit(1);
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) == -1) { perror("waitpid"); return false; }
+    if (WIFEXITED(status) && !WEXITSTATUS(status)) return true;
+
+    fprintf(stderr, "%s/%s: failed with status %d\n", alloc->name, workload->name, status);
+    return false;
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc == 4 && !strcmp(argv[1], "--run")) {
+        const struct workload *workload = workload_find(argv[3]);
+        return workload ? workload_exec(argv[2], workload) : 1;
+    }
+
+    if (argc > 3) {
+        fprintf(stderr, "usage: %s [libpmem.so [workload]]\n", argv[0]);
+        return 1;
+    }
+
+    char lib[PATH_MAX];
+    if (!realpath(argc > 1 ? argv[1] : "./libpmem.so", lib)) {
+        perror("realpath");
+        return 1;
+    }
+
+    const struct workload *only = NULL;
+    if (argc > 2 && !(only = workload_find(argv[2]))) {
+        fprintf(stderr, "unknown workload: %s\n", argv[2]);
+        return 1;
+    }
+
+    bool ok = true;
+    for (size_t i = 0; i < sizeof_arr(workloads); ++i) {
+        if (only && only != &workloads[i]) continue;
+        for (size_t j = 0; j < sizeof_arr(allocs); ++j)
+            ok = alloc_spawn(&allocs[j], lib, &workloads[i]) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
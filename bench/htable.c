@@ -0,0 +1,369 @@
+#include "common.h"
+
+#include <link.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// Compares htable against the probe-window table it replaced using pointer
+// keys drawn from the distributions the profiler sees:
+//
+// - heap: pointers returned by glibc's malloc for mixed lengths.
+// - code: instruction pointers within libc's executable segment.
+// - pages: page-aligned addresses of a contiguous mapping.
+//
+// Misses are looked up using non-canonical addresses which can never be
+// present. The reported cap is the number of buckets at the end of the puts.
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+
+// -----------------------------------------------------------------------------
+// mem
+// -----------------------------------------------------------------------------
+
+// htable.o only needs these from mem and pmem's allocator isn't what we're
+// measuring.
+
+void *mem_calloc(size_t n, size_t len) { return calloc(n, len); }
+void mem_free(void *ptr) { free(ptr); }
+
+
+// -----------------------------------------------------------------------------
+// legacy
+// -----------------------------------------------------------------------------
+
+// FNV-1a hash with a fixed probe window that doubles the table whenever a key
+// doesn't fit in its window.
+
+enum { legacy_window = 8 };
+
+static inline uint64_t legacy_hash(uint64_t key)
+{
+    const uint8_t *data = (uint8_t *) &key;
+
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < sizeof(key); ++i)
+        hash = (hash ^ data[i]) * 0x100000001b3;
+
+    return hash;
+}
+
+static bool legacy_table_put(
+        struct htable_bucket *table, size_t cap,
+        uint64_t key, uint64_t value)
+{
+    uint64_t hash = legacy_hash(key);
+
+    for (size_t i = 0; i < legacy_window; ++i) {
+        struct htable_bucket *bucket = &table[(hash + i) % cap];
+        if (bucket->key) continue;
+
+        bucket->key = key;
+        bucket->value = value;
+        return true;
+    }
+
+    return false;
+}
+
+static void legacy_resize(struct htable *ht, size_t cap)
+{
+    if (cap <= ht->cap) return;
+
+    size_t new_cap = ht->cap ? ht->cap : 1;
+    while (new_cap < cap) new_cap *= 2;
+
+    struct htable_bucket *new_table = calloc(new_cap, sizeof(*new_table));
+    for (size_t i = 0; i < ht->cap; ++i) {
+        struct htable_bucket *bucket = &ht->table[i];
+        if (!bucket->key) continue;
+
+        if (!legacy_table_put(new_table, new_cap, bucket->key, bucket->value)) {
+            free(new_table);
+            legacy_resize(ht, new_cap * 2);
+            return;
+        }
+    }
+
+    free(ht->table);
+    ht->cap = new_cap;
+    ht->table = new_table;
+}
+
+static void legacy_reset(struct htable *ht)
+{
+    free(ht->table);
+    *ht = (struct htable) {0};
+}
+
+static struct htable_ret legacy_get(struct htable *ht, uint64_t key)
+{
+    uint64_t hash = legacy_hash(key);
+    legacy_resize(ht, legacy_window);
+
+    for (size_t i = 0; i < legacy_window; ++i) {
+        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
+        if (bucket->key != key) continue;
+        return (struct htable_ret) { .ok = true, .value = bucket->value };
+    }
+
+    return (struct htable_ret) { .ok = false };
+}
+
+static struct htable_ret legacy_put(struct htable *ht, uint64_t key, uint64_t value)
+{
+    uint64_t hash = legacy_hash(key);
+    legacy_resize(ht, legacy_window);
+
+    for (size_t i = 0; i < legacy_window; ++i) {
+        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
+
+        if (bucket->key) {
+            if (bucket->key != key) continue;
+            return (struct htable_ret) { .ok = false, .value = bucket->value };
+        }
+
+        ht->len++;
+        bucket->key = key;
+        bucket->value = value;
+        return (struct htable_ret) { .ok = true };
+    }
+
+    legacy_resize(ht, ht->cap * 2);
+    return legacy_put(ht, key, value);
+}
+
+static struct htable_ret legacy_del(struct htable *ht, uint64_t key)
+{
+    uint64_t hash = legacy_hash(key);
+    legacy_resize(ht, legacy_window);
+
+    for (size_t i = 0; i < legacy_window; ++i) {
+        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
+        if (bucket->key != key) continue;
+
+        ht->len--;
+        bucket->key = 0;
+        return (struct htable_ret) { .ok = true, .value = bucket->value };
+    }
+
+    return (struct htable_ret) { .ok = false };
+}
+
+
+// -----------------------------------------------------------------------------
+// impls
+// -----------------------------------------------------------------------------
+
+struct impl
+{
+    const char *name;
+    void (*reset) (struct htable *);
+    struct htable_ret (*get) (struct htable *, uint64_t key);
+    struct htable_ret (*put) (struct htable *, uint64_t key, uint64_t value);
+    struct htable_ret (*del) (struct htable *, uint64_t key);
+};
+
+static const struct impl impls[] = {
+    {
+        .name = "legacy",
+        .reset = legacy_reset,
+        .get = legacy_get,
+        .put = legacy_put,
+        .del = legacy_del,
+    },
+    {
+        .name = "htable",
+        .reset = htable_reset,
+        .get = htable_get,
+        .put = htable_put,
+        .del = htable_del,
+    },
+};
+
+
+// -----------------------------------------------------------------------------
+// keys
+// -----------------------------------------------------------------------------
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15;
+
+static uint64_t rng(void)
+{
+    // xorshift64
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void shuffle(uint64_t *keys, size_t len)
+{
+    for (size_t i = len - 1; i > 0; --i) {
+        size_t j = rng() % (i + 1);
+        uint64_t tmp = keys[i];
+        keys[i] = keys[j];
+        keys[j] = tmp;
+    }
+}
+
+static void keys_heap(uint64_t *keys, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) {
+        keys[i] = (uintptr_t) malloc(16 + rng() % 512);
+        if (!keys[i]) abort();
+    }
+}
+
+static void keys_heap_free(uint64_t *keys, size_t len)
+{
+    for (size_t i = 0; i < len; ++i) free((void *) keys[i]);
+}
+
+struct text { uint64_t start, len; };
+
+static int find_text(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void) size;
+    if (!strstr(info->dlpi_name, "libc.so")) return 0;
+
+    struct text *text = data;
+    for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) continue;
+
+        text->start = info->dlpi_addr + phdr->p_vaddr;
+        text->len = phdr->p_memsz;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Duplicates are replaced by consecutive addresses which are still plausible
+// return addresses.
+static void keys_code(uint64_t *keys, size_t len)
+{
+    struct text text = {0};
+    if (!dl_iterate_phdr(find_text, &text)) abort();
+
+    struct htable seen = {0};
+    for (size_t i = 0; i < len; ++i) {
+        uint64_t key = text.start + rng() % text.len;
+        while (!htable_put(&seen, key, 0).ok) key++;
+        keys[i] = key;
+    }
+    htable_reset(&seen);
+}
+
+static void *pages = NULL;
+
+static void keys_pages(uint64_t *keys, size_t len)
+{
+    const size_t page_len = 4096;
+    pages = mmap(NULL, len * page_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pages == MAP_FAILED) abort();
+
+    for (size_t i = 0; i < len; ++i)
+        keys[i] = (uintptr_t) pages + i * page_len;
+}
+
+static void keys_pages_free(uint64_t *keys, size_t len)
+{
+    (void) keys;
+    munmap(pages, len * 4096);
+}
+
+struct dist
+{
+    const char *name;
+    void (*gen) (uint64_t *keys, size_t len);
+    void (*free) (uint64_t *keys, size_t len);
+};
+
+static const struct dist dists[] = {
+    { .name = "heap", .gen = keys_heap, .free = keys_heap_free },
+    { .name = "code", .gen = keys_code, .free = NULL },
+    { .name = "pages", .gen = keys_pages, .free = keys_pages_free },
+};
+
+
+// -----------------------------------------------------------------------------
+// bench
+// -----------------------------------------------------------------------------
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void check(bool cond, const struct impl *impl, const char *op)
+{
+    if (cond) return;
+    fprintf(stderr, "%s: invalid %s result\n", impl->name, op);
+    abort();
+}
+
+static void run(const struct impl *impl, const char *dist, const uint64_t *keys, size_t len)
+{
+    struct htable ht = {0};
+    uint64_t start = 0;
+
+    start = now_ns();
+    for (size_t i = 0; i < len; ++i)
+        check(impl->put(&ht, keys[i], i).ok, impl, "put");
+    uint64_t put = now_ns() - start;
+    size_t cap = ht.cap;
+
+    start = now_ns();
+    for (size_t i = 0; i < len; ++i)
+        check(impl->get(&ht, keys[i]).value == i, impl, "get");
+    uint64_t get = now_ns() - start;
+
+    start = now_ns();
+    for (size_t i = 0; i < len; ++i)
+        check(!impl->get(&ht, keys[i] ^ (1UL << 62)).ok, impl, "miss");
+    uint64_t miss = now_ns() - start;
+
+    start = now_ns();
+    for (size_t i = 0; i < len; ++i)
+        check(impl->del(&ht, keys[i]).value == i, impl, "del");
+    uint64_t del = now_ns() - start;
+
+    check(!ht.len, impl, "len");
+    impl->reset(&ht);
+
+    printf("%-6s %-5s n=%-8zu put=%-4lu get=%-4lu miss=%-4lu del=%-4lu cap=%zu\n",
+            impl->name, dist, len,
+            put / len, get / len, miss / len, del / len, cap);
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    const size_t lens[] = { 1UL << 10, 1UL << 16, 1UL << 20 };
+
+    for (size_t i = 0; i < sizeof_arr(dists); ++i) {
+        const struct dist *dist = &dists[i];
+
+        for (size_t j = 0; j < sizeof_arr(lens); ++j) {
+            size_t len = lens[j];
+            uint64_t *keys = calloc(len, sizeof(*keys));
+
+            dist->gen(keys, len);
+            uint64_t *shuffled = calloc(len, sizeof(*keys));
+            memcpy(shuffled, keys, len * sizeof(*keys));
+            shuffle(shuffled, len);
+
+            for (size_t k = 0; k < sizeof_arr(impls); ++k)
+                run(&impls[k], dist->name, shuffled, len);
+
+            if (dist->free) dist->free(keys, len);
+            free(shuffled);
+            free(keys);
+        }
+    }
+}
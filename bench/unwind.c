@@ -0,0 +1,73 @@
+#include "common.h"
+
+#include <time.h>
+
+// Compares the per-allocation capture cost of the stack unwinding backends at
+// various stack depths. Built with -fno-omit-frame-pointer so that all the
+// backends see the same stack.
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+typedef size_t (*backend_fn) (uint64_t *ips, size_t cap);
+
+struct backend
+{
+    const char *name;
+    backend_fn fn;
+};
+
+static const struct backend backends[] = {
+    { .name = "fp", .fn = unwind_fp },
+    { .name = "glibc", .fn = unwind_glibc },
+#ifdef PMEM_LIBUNWIND
+    { .name = "libunwind", .fn = unwind_libunwind },
+#endif
+};
+
+enum { iterations = 100000 };
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static size_t run(backend_fn fn, size_t *frames)
+{
+    uint64_t ips[PMEM_MAX_DEPTH];
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < iterations; ++i) {
+        *frames = fn(ips, sizeof_arr(ips));
+        __asm__ volatile ("" : : "r" (ips) : "memory");
+    }
+
+    return (now_ns() - start) / iterations;
+}
+
+__attribute__((noinline))
+static void recurse(size_t depth, const struct backend *backend)
+{
+    if (depth) {
+        recurse(depth - 1, backend);
+        __asm__ volatile ("");
+        return;
+    }
+
+    size_t frames = 0;
+    size_t ns = run(backend->fn, &frames);
+    printf("%-10s frames=%-4zu ns/op=%zu\n", backend->name, frames, ns);
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    const size_t depths[] = { 0, 8, 32, 96 };
+
+    for (size_t i = 0; i < sizeof_arr(depths); ++i) {
+        for (size_t j = 0; j < sizeof_arr(backends); ++j)
+            recurse(depths[i], &backends[j]);
+    }
+}
@@ -5,15 +5,28 @@ set -o errexit -o nounset -o pipefail -o xtrace
 : ${PREFIX:="."}
 
 declare -a SRC
-SRC=(htable mem prof pmem)
+SRC=(htable mem prof unwind pmem)
+
+declare -a TOOLS
+TOOLS=(report)
 
 declare -a TEST
-TEST=(basics)
+TEST=(basics threads realloc align stats decay fork)
+
+# Tests of pmem's internals which link against its objects instead of being run
+# with libpmem.so preloaded.
+declare -a TEST_OBJ
+TEST_OBJ=(symbols)
+
+# Benchmarks along with the objects they link against. Linking everything would
+# pull in pmem's malloc which is rarely what we want to measure.
+declare -A BENCH
+BENCH=([unwind]="unwind.o" [htable]="htable.o" [alloc]="")
 
 CC=${OTHERC:-gcc}
 
 CFLAGS="-ggdb -O3 -march=native -pipe -std=gnu11 -D_GNU_SOURCE"
-CFLAGS="$CFLAGS -I${PREFIX}/src"
+CFLAGS="$CFLAGS -I${PREFIX}/src -I${PREFIX}/include"
 
 CFLAGS="$CFLAGS -fPIC"
 CFLAGS="$CFLAGS -fvisibility=hidden"
@@ -31,9 +44,14 @@ CFLAGS="$CFLAGS -Winit-self"
 CFLAGS="$CFLAGS -Wno-strict-aliasing"
 CFLAGS="$CFLAGS -Wno-implicit-fallthrough"
 
+LDFLAGS="-pthread -lm"
+
+grep -q '^#define PMEM_FRAME_POINTER$' "${PREFIX}/config.h" && \
+    CFLAGS="$CFLAGS -fno-omit-frame-pointer"
+
 # Feels a bit dirty but oh well
 grep -q '^#define PMEM_LIBUNWIND$' "${PREFIX}/config.h" && \
-    CFLAGS="$CFLAGS -lunwind"
+    LDFLAGS="$LDFLAGS -lunwind"
 
 OBJ=""
 for src in "${SRC[@]}"; do
@@ -41,9 +59,24 @@ for src in "${SRC[@]}"; do
     OBJ="$OBJ $src.o"
 done
 
-$CC -o libpmem.so -shared $OBJ
+$CC -o libpmem.so -shared $OBJ $LDFLAGS
+
+for tool in "${TOOLS[@]}"; do
+    $CC -o "pmem-$tool" "${PREFIX}/tools/$tool.c" $CFLAGS
+done
+
+# Benchmarks are built but not run as they take a while.
+for bench in "${!BENCH[@]}"; do
+    $CC -o "bench_$bench" "${PREFIX}/bench/$bench.c" ${BENCH[$bench]} \
+        $CFLAGS -fno-omit-frame-pointer $LDFLAGS
+done
 
 for test in "${TEST[@]}"; do
-    $CC -o "test_$test" "${PREFIX}/test/$test.c" $CFLAGS
+    $CC -o "test_$test" "${PREFIX}/test/$test.c" $CFLAGS $LDFLAGS
     LD_PRELOAD=./libpmem.so "./test_$test"
 done
+
+for test in "${TEST_OBJ[@]}"; do
+    $CC -o "test_$test" "${PREFIX}/test/$test.c" $OBJ $CFLAGS $LDFLAGS
+    "./test_$test"
+done
@@ -1,7 +1,85 @@
 
+// Options marked as runtime can also be set through the environment variable of
+// the same name when the program starts. Values are in base 10 and sizes in
+// bytes also accept a k, m or g suffix.
+
 // If defined, pmem will use libunwind to collect the source's stack
-// frames. Otherwise, pmem will fallback on glibc's backtrace.
+// frames. Otherwise, pmem will fallback on glibc's backtrace. Symbolization
+// relies on unw_get_proc_name_by_ip which requires libunwind 1.7 or later.
 #define PMEM_LIBUNWIND
 
+// If defined, pmem will walk the frame pointer chain to collect the source's
+// stack frames and only fall back on libunwind or glibc's backtrace when the
+// chain looks broken. Only worth it if the profiled program is compiled with
+// -fno-omit-frame-pointer.
+// #define PMEM_FRAME_POINTER
+
+// If 0, pmem is only used as an allocator: nothing is profiled and no snapshots
+// are dumped. Runtime.
+#define PMEM_PROFILE 1
+
+// Format of the snapshots:
+// - "text": appended to ./pmem.$(pid).log as described in the README.
+// - "bin": appended to ./pmem.$(pid).bin in a compact binary format where
+//   backtraces and symbols are only written once. Decoded by pmem-report.
+// - "pprof": gperftools heap profile written to ./pmem.$(pid).$(snapshot).heap
+// - "collapsed": collapsed stacks for flamegraph.pl written to
+//   ./pmem.$(pid).$(snapshot).{inuse,alloc}.folded
+// Runtime.
+#define PMEM_FORMAT "text"
+
+// Maximum number of stack frames recorded for each source.
+#define PMEM_MAX_DEPTH 128
+
 // Defines the threshold to dump a memory profile in bytes allocated and freed.
+// 0 disables the trigger. Runtime.
 #define PMEM_CHURN_THRESH (1UL << 20) // 1Mb
+
+// Dumps a memory profile if none were dumped for this many milliseconds. 0
+// disables the trigger. Runtime.
+#define PMEM_PERIOD 0
+
+// Dumps a memory profile when this signal is received (eg. SIGUSR2). The
+// environment variable also accepts USR1 and USR2. 0 disables the trigger.
+// Runtime.
+#define PMEM_SIGNAL 0
+
+// Dumps a memory profile every time the live bytes of the heap go this many
+// bytes over the previous high-water mark. 0 disables the trigger. Runtime.
+#define PMEM_HWM_STEP 0
+
+// Prefix of the files written by the dumps. Runtime.
+#define PMEM_PATH "./pmem"
+
+// Allocations freed within this many milliseconds are reported as short-lived
+// in the lifetime histograms. Must be a power of 2.
+#define PMEM_LIFETIME_SHORT 1024 // ~1s
+
+// If non-zero, snapshots only include the N sources holding the most live
+// bytes and the N sources whose live bytes grew the most since the snapshot
+// taken PMEM_TOP_WINDOW snapshots ago. 0 includes every source. Runtime for
+// PMEM_TOP_N.
+#define PMEM_TOP_N 0
+#define PMEM_TOP_WINDOW 8
+
+// Mean number of bytes allocated between two profiled allocations. Allocations
+// are sampled and the reported counts are scaled by the inverse of their
+// sampling probability. 0 profiles every allocation. Runtime.
+#define PMEM_SAMPLE_INTERVAL 0
+
+// Size in bytes of the regions reserved from the OS and carved into blocks for
+// the size classes. Large allocations are also aligned on this length. Must be
+// a power of 2 of at least 128Kb.
+#define PMEM_SPAN_LEN (1UL << 20) // 1Mb
+
+// Spans with no blocks in use are returned to the OS after having been empty
+// for this many milliseconds. malloc_trim can be used to release them sooner.
+#define PMEM_SPAN_DECAY 1000 // 1s
+
+// Maximum number of bytes of freed large allocations (over 32Kb) that are kept
+// mapped for reuse instead of being returned to the OS.
+#define PMEM_VMA_CACHE_LEN (64UL << 20) // 64Mb
+
+// Freed large allocations that haven't been reused after this many
+// milliseconds are returned to the OS.
+#define PMEM_VMA_CACHE_DECAY 1000 // 1s
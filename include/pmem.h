@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+
+// Public interface of pmem besides the standard malloc entry points. Programs
+// that only get pmem through LD_PRELOAD can still use it as the functions are
+// declared weak and are therefore NULL when pmem isn't loaded:
+//
+//   struct pmem_stats stats;
+//   if (pmem_stats) pmem_stats(&stats);
+
+
+// -----------------------------------------------------------------------------
+// stats
+// -----------------------------------------------------------------------------
+
+// Number of size classes reported by pmem_stats.
+enum { pmem_stats_classes = 40 };
+
+struct pmem_stats_class
+{
+    size_t len;   // Length of the blocks in the class.
+    size_t spans; // Spans of span_len bytes currently mapped for the class.
+    size_t empty; // Spans with no blocks in use waiting to be returned to the OS.
+    size_t used;  // Blocks handed out including the ones held in thread caches.
+    size_t free;  // Blocks sitting on the free lists of the spans.
+};
+
+struct pmem_stats
+{
+    size_t span_len;
+    struct pmem_stats_class classes[pmem_stats_classes];
+
+    size_t vma_count;     // Live allocations too large for the size classes.
+    size_t vma_bytes;     // Bytes mapped for the live vma allocations.
+    size_t vma_requested; // Bytes requested for the live vma allocations.
+    size_t vma_cached;    // Bytes of freed vma allocations kept mapped for reuse.
+
+    size_t sources;       // Allocation sources tracked by the profiler.
+    size_t prof_bytes;    // Bytes allocated by the profiler for its own use.
+};
+
+// Counters are maintained as the allocator runs so this only takes a handful
+// of uncontended locks and is cheap enough to be called every second.
+__attribute__((weak)) void pmem_stats(struct pmem_stats *stats);
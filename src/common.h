@@ -11,6 +11,7 @@
 #include <stdatomic.h>
 
 #include "../config.h"
+#include "../include/pmem.h"
 
 // -----------------------------------------------------------------------------
 // attributes
@@ -19,16 +20,31 @@
 #define pmem_public __attribute__((visibility("default")))
 #define pmem_malloc __attribute__((malloc))
 
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
 
 // -----------------------------------------------------------------------------
 // mem
 // -----------------------------------------------------------------------------
 
 pmem_malloc void *mem_alloc(size_t len);
+pmem_malloc void *mem_alloc_aligned(size_t align, size_t len);
 pmem_malloc void *mem_calloc(size_t n, size_t len);
 void *mem_realloc(void *ptr, size_t len);
 void mem_free(void *ptr);
 size_t mem_usable_size(void *ptr);
+size_t mem_trim(void);
+void mem_decay(void);
+
+void mem_tag_set(void *ptr, uint64_t tag);
+uint64_t mem_tag_take(void *ptr);
+
+void mem_stats(struct pmem_stats *stats);
+
+void mem_fork_prepare(void);
+void mem_fork_parent(void);
+void mem_fork_child(void);
 
 
 // -----------------------------------------------------------------------------
@@ -37,6 +53,72 @@ size_t mem_usable_size(void *ptr);
 
 void prof_alloc(void *ptr, size_t len);
 void prof_free(void *ptr);
+void prof_stats(struct pmem_stats *stats);
+
+void prof_fork_prepare(void);
+void prof_fork_parent(void);
+void prof_fork_child(void);
+
+// Returns the interned name of the symbol containing ip which is shared by
+// every ip within that symbol. Exposed for testing purposes.
+const char *prof_symbol_name(uint64_t ip, uint64_t *off);
+
+// -----------------------------------------------------------------------------
+// unwind
+// -----------------------------------------------------------------------------
+
+// Captures the instruction pointers of the current thread's stack using the
+// backend selected in config.h.
+size_t unwind(uint64_t *ips, size_t cap);
+
+// Writes the nul-terminated name of the symbol containing ip. Returns the
+// length of the name which was truncated if the return value is not smaller
+// than len, in which case the call should be retried with a larger buffer.
+size_t unwind_symbol(uint64_t ip, char *name, size_t len, uint64_t *off);
+
+// Individual backends which are exposed for benchmarking purposes. The
+// libunwind backend is only available if PMEM_LIBUNWIND is defined.
+size_t unwind_fp(uint64_t *ips, size_t cap);
+size_t unwind_glibc(uint64_t *ips, size_t cap);
+size_t unwind_libunwind(uint64_t *ips, size_t cap);
+
+
+// -----------------------------------------------------------------------------
+// bin
+// -----------------------------------------------------------------------------
+
+// Binary snapshot format written with the "bin" PMEM_FORMAT and decoded by
+// pmem-report. The file starts with the magic followed by the version as a
+// native u32. Each record that follows is a u8 type and a native u32 length
+// followed by that many bytes of payload which allows readers to skip over the
+// records they're not interested in. Integers in payloads are LEB128 varints.
+//
+// - symbol: id, offset, name (remaining bytes)
+// - stack: id, hash, depth, symbol id * depth
+// - snapshot: index, churn, threshold, trigger mask (churn, timer, signal and
+//   hwm from the lowest bit), sample, short-lived lifetime, top n (0 if
+//   disabled) and top window; rss, span length, vma mapped, requested and
+//   cached bytes, number of size classes followed by the length, spans, used
+//   blocks and free blocks of each; followed by entries until the end of:
+//   stack id; alloc_curr, alloc_total, free_curr
+//   and free_total for both the calls and the bytes; the size and lifetime
+//   histograms each as a number of buckets followed by pairs of bucket index
+//   and count; the zigzag encoded change in live bytes over the top window.
+//
+// Ids are assigned sequentially from 0 for each record type and are always
+// written before they are referenced.
+
+#define PMEM_BIN_MAGIC "pmem"
+
+enum { pmem_bin_version = 6 };
+
+enum pmem_bin_type
+{
+    pmem_bin_symbol = 1,
+    pmem_bin_stack = 2,
+    pmem_bin_snapshot = 3,
+};
+
 
 // -----------------------------------------------------------------------------
 // lock
@@ -48,6 +130,12 @@ void pmem_lock(lock_t *lock);
 bool pmem_try_lock(lock_t *lock);
 void pmem_unlock(lock_t *lock);
 
+// Blocks while the word is equal to value, until woken up or until timeout
+// milliseconds have elapsed if non-zero. Can return spuriously so the caller
+// must re-check its condition. pmem_wake is async-signal-safe.
+void pmem_wait(atomic_int *word, int value, uint64_t timeout);
+void pmem_wake(atomic_int *word);
+
 
 // -----------------------------------------------------------------------------
 // htable
@@ -1,27 +1,48 @@
 #include "common.h"
 
+// Open addressing with linear probing and Robin Hood insertion: a key being
+// inserted takes the bucket of any key that is closer to its home bucket which
+// bounds the variance of the probe lengths. Lookups can then stop as soon as
+// they reach a key closer to its home than the one searched and deletions
+// shift the following keys back instead of leaving tombstones.
+//
+// The probe distance of a key is recomputed from its hash rather than stored
+// which keeps the buckets at 16 bytes.
+
 // -----------------------------------------------------------------------------
 // config
 // -----------------------------------------------------------------------------
 
-enum { probe_window = 8 };
+enum
+{
+    min_cap = 16,
+
+    // The table grows once it's more than load_num/load_den full.
+    load_num = 7,
+    load_den = 8,
+};
 
 
 // -----------------------------------------------------------------------------
 // hash
 // -----------------------------------------------------------------------------
 
-// FNV-1a hash implementation: http://isthe.com/chongo/tech/comp/fnv/
+// Finalizer of murmur3's 64 bits hash which mixes the whole key at once. Unlike
+// FNV, the low bits of the output depend on all the bits of the key which is
+// what matters for the pointers we use as keys whose low bits are mostly zero.
 static inline uint64_t hash_key(uint64_t key)
 {
-    const uint8_t *data = (uint8_t *) &key;
-
-    uint64_t hash = 0xcbf29ce484222325;
-    for (size_t i = 0; i < sizeof(key); ++i)
-        hash = (hash ^ data[i]) * 0x100000001b3;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
+    return key;
+}
 
-    assert(hash); // \todo Can't be 0
-    return hash;
+static inline size_t probe_dist(size_t mask, size_t index, uint64_t key)
+{
+    return (index - hash_key(key)) & mask;
 }
 
 
@@ -35,42 +56,46 @@ void htable_reset(struct htable *ht)
     *ht = (struct htable) {0};
 }
 
-static bool table_put(
+// Key must not already be present in the table.
+static void table_insert(
         struct htable_bucket *table, size_t cap,
         uint64_t key, uint64_t value)
 {
     assert(key);
-    uint64_t hash = hash_key(key);
 
-    for (size_t i = 0; i < probe_window; ++i) {
-        struct htable_bucket *bucket = &table[(hash + i) % cap];
-        if (bucket->key) continue;
+    size_t mask = cap - 1;
+    size_t index = hash_key(key) & mask;
+    struct htable_bucket item = { .key = key, .value = value };
 
-        bucket->key = key;
-        bucket->value = value;
-        return true;
-    }
+    for (size_t dist = 0;; ++dist, index = (index + 1) & mask) {
+        struct htable_bucket *bucket = &table[index];
+
+        if (!bucket->key) {
+            *bucket = item;
+            return;
+        }
 
-    return false;
+        size_t other = probe_dist(mask, index, bucket->key);
+        if (other >= dist) continue;
+
+        struct htable_bucket tmp = *bucket;
+        *bucket = item;
+        item = tmp;
+        dist = other;
+    }
 }
 
 static void htable_resize(struct htable *ht, size_t cap)
 {
     if (cap <= ht->cap) return;
 
-    size_t new_cap = ht->cap ? ht->cap : 1;
+    size_t new_cap = ht->cap ? ht->cap : min_cap;
     while (new_cap < cap) new_cap *= 2;
 
     struct htable_bucket *new_table = mem_calloc(new_cap, sizeof(*new_table));
     for (size_t i = 0; i < ht->cap; ++i) {
         struct htable_bucket *bucket = &ht->table[i];
-        if (!bucket->key) continue;
-
-        if (!table_put(new_table, new_cap, bucket->key, bucket->value)) {
-            mem_free(new_table);
-            htable_resize(ht, new_cap * 2);
-            return;
-        }
+        if (bucket->key) table_insert(new_table, new_cap, bucket->key, bucket->value);
     }
 
     mem_free(ht->table);
@@ -80,74 +105,71 @@ static void htable_resize(struct htable *ht, size_t cap)
 
 void htable_reserve(struct htable *ht, size_t items)
 {
-    htable_resize(ht, items * 4);
+    htable_resize(ht, (items * load_den + load_num - 1) / load_num);
 }
 
-
-// -----------------------------------------------------------------------------
-// ops
-// -----------------------------------------------------------------------------
-
-struct htable_ret htable_get(struct htable *ht, uint64_t key)
+// Returns the index of the key or cap if it's not in the table.
+static size_t htable_find(struct htable *ht, uint64_t key)
 {
     assert(key);
+    if (!ht->cap) return 0;
 
-    uint64_t hash = hash_key(key);
-    htable_resize(ht, probe_window);
-
-    for (size_t i = 0; i < probe_window; ++i) {
-        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
+    size_t mask = ht->cap - 1;
+    size_t index = hash_key(key) & mask;
 
-        if (!bucket->key) continue;
-        if (bucket->key != key) continue;
+    for (size_t dist = 0;; ++dist, index = (index + 1) & mask) {
+        struct htable_bucket *bucket = &ht->table[index];
 
-        return (struct htable_ret) { .ok = true, .value = bucket->value };
+        if (bucket->key == key) return index;
+        if (!bucket->key) return ht->cap;
+        if (probe_dist(mask, index, bucket->key) < dist) return ht->cap;
     }
-
-    return (struct htable_ret) { .ok = false };
 }
 
-struct htable_ret htable_put(struct htable *ht, uint64_t key, uint64_t value)
-{
-    assert(key);
 
-    uint64_t hash = hash_key(key);
-    htable_resize(ht, probe_window);
+// -----------------------------------------------------------------------------
+// ops
+// -----------------------------------------------------------------------------
 
-    for (size_t i = 0; i < probe_window; ++i) {
-        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
+struct htable_ret htable_get(struct htable *ht, uint64_t key)
+{
+    size_t index = htable_find(ht, key);
+    if (index == ht->cap) return (struct htable_ret) { .ok = false };
+    return (struct htable_ret) { .ok = true, .value = ht->table[index].value };
+}
 
-        if (bucket->key) {
-            if (bucket->key != key) continue;
-            return (struct htable_ret) { .ok = false, .value = bucket->value };
-        }
+struct htable_ret htable_put(struct htable *ht, uint64_t key, uint64_t value)
+{
+    size_t index = htable_find(ht, key);
+    if (index != ht->cap)
+        return (struct htable_ret) { .ok = false, .value = ht->table[index].value };
 
-        ht->len++;
-        bucket->key = key;
-        bucket->value = value;
-        return (struct htable_ret) { .ok = true };
-    }
+    htable_reserve(ht, ht->len + 1);
+    table_insert(ht->table, ht->cap, key, value);
+    ht->len++;
 
-    htable_resize(ht, ht->cap * 2);
-    return htable_put(ht, key, value);
+    return (struct htable_ret) { .ok = true };
 }
 
 struct htable_ret htable_del(struct htable *ht, uint64_t key)
 {
-    uint64_t hash = hash_key(key);
-    htable_resize(ht, probe_window);
-
-    for (size_t i = 0; i < probe_window; ++i) {
-        struct htable_bucket *bucket = &ht->table[(hash + i) % ht->cap];
-
-        if (bucket->key != key) continue;
-
-        ht->len--;
-        bucket->key = 0;
-        return (struct htable_ret) { .ok = true, .value = bucket->value };
+    size_t index = htable_find(ht, key);
+    if (index == ht->cap) return (struct htable_ret) { .ok = false };
+
+    uint64_t value = ht->table[index].value;
+    ht->len--;
+
+    // Backward shift: pull the following keys one bucket closer to their home
+    // until we reach an empty bucket or a key already in its home bucket.
+    size_t mask = ht->cap - 1;
+    for (size_t next = (index + 1) & mask;; index = next, next = (next + 1) & mask) {
+        struct htable_bucket *bucket = &ht->table[next];
+        if (!bucket->key || !probe_dist(mask, next, bucket->key)) break;
+        ht->table[index] = *bucket;
     }
 
-    return (struct htable_ret) { .ok = false };
+    ht->table[index] = (struct htable_bucket) {0};
+    return (struct htable_ret) { .ok = true, .value = value };
 }
 
 struct htable_bucket * htable_next(struct htable *ht, struct htable_bucket *bucket)
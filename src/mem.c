@@ -1,17 +1,129 @@
+#include <time.h>
+#include <pthread.h>
 #include <sys/mman.h>
 
 #include "common.h"
 
 
 // -----------------------------------------------------------------------------
-// state
+// config
 // -----------------------------------------------------------------------------
 
-static lock_t mem_lock = 0;
-static void *buckets[8] = {0};
+enum { bucket_count = 40 };
+
 static const size_t bucket_vma = -1UL;
 static const size_t page_len = 4096UL;
 
+// Size classes are carved out of spans that are aligned on their own length
+// and which start with a page aligned header. vma allocations are also aligned
+// on the span length which is how the two are told apart: a block never sits
+// at the start of a span.
+static const size_t span_len = PMEM_SPAN_LEN;
+
+// Spans with no blocks in use are returned to the OS once they've been empty
+// for this many milliseconds. Checks are driven by the clock from the slow
+// paths and from mem_decay and are done at most once per interval.
+static const uint64_t span_decay = PMEM_SPAN_DECAY;
+
+// vma lengths are rounded up to a power of 2 number of pages below the span
+// length and to a multiple of the span length above it. The headroom lets
+// realloc grow in place most of the time and it's only backed by the kernel
+// once it's touched.
+static const size_t vma_small_classes = __builtin_ctzl(PMEM_SPAN_LEN / 4096);
+
+// Freed vma allocations are kept around for reuse in bins indexed by their
+// length class. Lookups take the smallest entry that is at most
+// vma_cache_slack times the requested length. An LRU list threaded across all
+// bins is used to evict the oldest entries when the cache is over capacity or
+// when they decay.
+enum { vma_cache_bins = 256, vma_cache_slack = 2 };
+static const size_t vma_cache_cap = PMEM_VMA_CACHE_LEN;
+static const uint64_t vma_cache_decay = PMEM_VMA_CACHE_DECAY;
+
+// Per-thread caches are refilled from and flushed to the global buckets in
+// batches of roughly this many bytes.
+static const size_t cache_batch_bytes = 16UL * 1024;
+
+
+// -----------------------------------------------------------------------------
+// state
+// -----------------------------------------------------------------------------
+
+// Blocks handed out to the thread caches count as used so a span is only empty
+// once all its blocks made it back.
+struct span
+{
+    size_t bucket;
+    void *first, *bump, *end;
+
+    // Protected by the bucket's lock.
+    void *free;
+    size_t used;
+    uint64_t time;
+    struct span *next, *prev;
+
+    // One tag per block which is only touched by whoever owns the block.
+    uint64_t tags[];
+};
+
+// Full spans aren't tracked as they make it back on the partial list as soon
+// as one of their blocks is freed.
+struct bucket
+{
+    lock_t lock;
+    struct span *partial;
+    struct span *empty;
+
+    // Stats reported by mem_stats which are also protected by the lock.
+    size_t spans, spans_empty;
+    size_t used, free;
+} __attribute__((aligned(64)));
+
+static struct bucket buckets[bucket_count] = {0};
+static atomic_uint_fast64_t span_purge_last = 0;
+
+
+// Metadata for vma allocations is kept out of the mapping in a two level radix
+// tree indexed by span number.
+struct vma
+{
+    void *ptr;
+    size_t len, requested;
+
+    uint64_t tag;
+
+    // Only meaningful while the vma sits in the cache.
+    uint64_t time;
+    struct vma *next, *prev;
+    struct vma *lru_next, *lru_prev;
+};
+
+enum
+{
+    radix_leaf_len = 1UL << 12,
+    radix_root_len = (1UL << 47) / PMEM_SPAN_LEN / radix_leaf_len,
+};
+
+static _Atomic(struct vma *) radix[radix_root_len] = {0};
+
+static struct
+{
+    lock_t lock;
+    size_t len;
+    struct vma *bins[vma_cache_bins];
+    struct vma *lru_head, *lru_tail;
+} vma_cache = {0};
+
+// Live vma allocations which excludes the ones sitting in the cache. Only
+// updated alongside a syscall or a cache lock so the atomics are never on the
+// hot path.
+static struct
+{
+    atomic_size_t count;
+    atomic_size_t bytes;
+    atomic_size_t requested;
+} vma_live = {0};
+
 
 // -----------------------------------------------------------------------------
 // utils
@@ -37,62 +149,196 @@ static inline void *ptr_dec(void *ptr, size_t len)
     return ((uint8_t *) ptr) - len;
 }
 
+static inline size_t align_up(size_t value, size_t align)
+{
+    return (value + (align - 1)) & ~(align - 1);
+}
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+}
+
+static inline struct span *ptr_to_span(void *ptr)
+{
+    return (struct span *) (((uintptr_t) ptr) & ~(span_len - 1));
+}
+
 static size_t ptr_to_bucket(void *ptr)
 {
-    static const uintptr_t mask = page_len - 1;
-    void *masked = (void *) (((uint64_t) ptr) & ~mask);
-    return ptr == masked ? bucket_vma : ptr_read_u64(masked);
+    struct span *span = ptr_to_span(ptr);
+    return (void *) span == ptr ? bucket_vma : span->bucket;
 }
 
+// Classes are spaced by 16 bytes up to 128 bytes and then by four classes per
+// power of two up to 32Kb. Indexed by (len + 15) / 16 up to 1Kb.
+static const uint8_t bucket_small[] = {
+    0,  0,  1,  2,  3,  4,  5,  6,  7,  8,  8,  9,  9, 10, 10, 11,
+    11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14, 14, 15, 15, 15,
+    15, 16, 16, 16, 16, 16, 16, 16, 16, 17, 17, 17, 17, 17, 17, 17,
+    17, 18, 18, 18, 18, 18, 18, 18, 18, 19, 19, 19, 19, 19, 19, 19,
+    19,
+};
+
+static const uint32_t bucket_lens[bucket_count] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096,
+    5120, 6144, 7168, 8192,
+    10240, 12288, 14336, 16384,
+    20480, 24576, 28672, 32768,
+};
+
+static_assert(sizeof(bucket_small) == 65, "invalid small bucket table");
+
 static size_t len_to_bucket(size_t len)
 {
-    if (len <= 8) return 0;
-    if (len <= 16) return 1;
-    if (len <= 32) return 2;
-    if (len <= 64) return 3;
-    if (len <= 128) return 4;
-    if (len <= 256) return 5;
-    if (len <= 512) return 6;
-    if (len <= 1024) return 7;
-    return bucket_vma;
+    if (likely(len <= 1024)) return bucket_small[(len + 15) >> 4];
+    if (len > 32768) return bucket_vma;
+
+    size_t lg = 63 - __builtin_clzl(len - 1);
+    return 8 + (lg - 7) * 4 + (((len - 1) >> (lg - 2)) & 3);
 }
 
 static size_t bucket_to_len(size_t bucket)
 {
-    return 1UL << (4 + bucket);
+    return bucket_lens[bucket];
+}
+
+// mmap doesn't do alignment so we over-reserve and trim both ends.
+static void *mmap_aligned(size_t len, size_t align, int prot)
+{
+    size_t reserve = len + align - page_len;
+    void *ptr = mmap(0, reserve, prot, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) return NULL;
+
+    void *start = (void *) align_up((uintptr_t) ptr, align);
+    size_t head = (uintptr_t) start - (uintptr_t) ptr;
+    size_t tail = reserve - head - len;
+
+    if (head) munmap(ptr, head);
+    if (tail) munmap(ptr_inc(start, len), tail);
+    return start;
 }
 
+
 // -----------------------------------------------------------------------------
-// vma
+// span
 // -----------------------------------------------------------------------------
 
-static inline size_t to_vma_len(size_t len)
+static_assert(PMEM_SPAN_LEN % 4096 == 0, "span must be page aligned");
+static_assert((PMEM_SPAN_LEN & (PMEM_SPAN_LEN - 1)) == 0, "span must be a power of 2");
+static_assert(PMEM_SPAN_LEN >= 4 * 32768, "span too small for the largest class");
+
+// Spans are dedicated to a single size class and are carved lazily through a
+// bump pointer so the kernel only backs the pages as they get used.
+// The header holds the tag array so its length depends on the number of blocks
+// which in turn depends on the length of the header.
+static size_t span_layout(size_t bucket, size_t *hdr_len)
 {
-    return (len + (page_len - 1)) & ~(page_len - 1);
+    size_t len = bucket_to_len(bucket);
+    size_t blocks = (span_len - page_len) / (len + sizeof(uint64_t));
+
+    while (true) {
+        *hdr_len = align_up(sizeof(struct span) + blocks * sizeof(uint64_t), page_len);
+        if (*hdr_len + blocks * len <= span_len) return blocks;
+        blocks--;
+    }
 }
 
-static void *vma_alloc(size_t len)
+static struct span *span_alloc(size_t bucket)
 {
-    size_t vma_len = to_vma_len(len) + page_len;
-    void *ptr = mmap(0, vma_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-    if (!ptr) return NULL;
+    struct span *span = mmap_aligned(span_len, span_len, PROT_READ | PROT_WRITE);
+    if (!span) return NULL;
+
+    size_t hdr_len = 0;
+    size_t blocks = span_layout(bucket, &hdr_len);
 
-    ptr_write_u64(ptr, vma_len);
-    return ptr_inc(ptr, page_len);
+    span->bucket = bucket;
+    span->first = span->bump = ptr_inc(span, hdr_len);
+    span->end = ptr_inc(span->first, blocks * bucket_to_len(bucket));
+    return span;
 }
 
-static void vma_free(void *raw)
+static inline uint64_t *span_tag(struct span *span, void *ptr)
 {
-    void *ptr = ptr_dec(raw, page_len);
-    size_t vma_len = ptr_read_u64(ptr);
+    size_t offset = (uintptr_t) ptr - (uintptr_t) span->first;
+    return &span->tags[offset / bucket_to_len(span->bucket)];
+}
 
-    munmap(ptr, vma_len);
+static inline bool span_full(struct span *span)
+{
+    return !span->free && span->bump == span->end;
+}
+
+static void span_push(struct span **list, struct span *span)
+{
+    span->prev = NULL;
+    span->next = *list;
+    if (span->next) span->next->prev = span;
+    *list = span;
 }
 
-static size_t vma_usable_size(void *raw)
+static void span_unlink(struct span **list, struct span *span)
 {
-    void *ptr = ptr_dec(raw, page_len);
-    return ptr_read_u64(ptr) - page_len;
+    if (span->prev) span->prev->next = span->next;
+    else *list = span->next;
+    if (span->next) span->next->prev = span->prev;
+    span->next = span->prev = NULL;
+}
+
+// Unmaps spans that have been empty for longer than the decay. This is rate
+// limited to one pass per decay interval unless forced which is used to
+// release all the empty spans regardless of their age. Returns the number of
+// bytes released.
+static size_t span_purge(bool force)
+{
+    uint64_t now = clock_ms();
+
+    if (!force) {
+        uint64_t last = atomic_load_explicit(&span_purge_last, memory_order_relaxed);
+        if (now - last < span_decay) return 0;
+        if (!atomic_compare_exchange_strong(&span_purge_last, &last, now)) return 0;
+    }
+
+    size_t released = 0;
+
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+        struct bucket *b = &buckets[bucket];
+        struct span *list = NULL;
+        pmem_lock(&b->lock);
+
+        struct span *next = NULL;
+        for (struct span *span = b->empty; span; span = next) {
+            next = span->next;
+            if (!force && now - span->time < span_decay) continue;
+
+            span_unlink(&b->empty, span);
+            span->next = list;
+            list = span;
+
+            b->spans--;
+            b->spans_empty--;
+            b->free -= ((uintptr_t) span->bump - (uintptr_t) span->first) / bucket_to_len(bucket);
+        }
+
+        pmem_unlock(&b->lock);
+
+        while (list) {
+            struct span *span = list;
+            list = span->next;
+
+            munmap(span, span_len);
+            released += span_len;
+        }
+    }
+
+    return released;
 }
 
 
@@ -100,71 +346,524 @@ static size_t vma_usable_size(void *raw)
 // bucket
 // -----------------------------------------------------------------------------
 
+// Must be called with the bucket's lock held.
 static void *bucket_alloc(size_t bucket)
 {
-    size_t len = bucket_to_len(bucket);
+    struct bucket *b = &buckets[bucket];
+
+    struct span *span = b->partial;
+    if (!span) {
+        span = b->empty;
+        if (span) { span_unlink(&b->empty, span); b->spans_empty--; }
+        else if ((span = span_alloc(bucket))) b->spans++;
+        else return NULL;
+        span_push(&b->partial, span);
+    }
 
-    if (!buckets[bucket]) {
-        void *ptr = mmap(0, page_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, 0, 0);
-        if (!ptr) return NULL;
+    void *ptr = span->free;
+    if (ptr) { span->free = (void *) ptr_read_u64(ptr); b->free--; }
+    else {
+        ptr = span->bump;
+        span->bump = ptr_inc(ptr, bucket_to_len(bucket));
+    }
+
+    span->used++;
+    b->used++;
+    if (span_full(span)) span_unlink(&b->partial, span);
+
+    return ptr;
+}
 
-        ptr_write_u64(ptr, bucket);
+// Must be called with the bucket's lock held.
+static void bucket_free(size_t bucket, void *ptr)
+{
+    struct bucket *b = &buckets[bucket];
+    struct span *span = ptr_to_span(ptr);
+
+    if (span_full(span)) span_push(&b->partial, span);
+
+    ptr_write_u64(ptr, (uint64_t) span->free);
+    span->free = ptr;
+    b->free++;
+    b->used--;
+
+    if (--span->used) return;
+
+    span_unlink(&b->partial, span);
+    span->time = clock_ms();
+    span_push(&b->empty, span);
+    b->spans_empty++;
+}
 
-        void *first = ptr_inc(ptr, len);
-        void *last = ptr_inc(ptr, page_len - len);
-        for (void *it = first; it < last; it = ptr_inc(it, len))
-            ptr_write_u64(it, (uint64_t) ptr_inc(it, len));
 
-        buckets[bucket] = first;
+// -----------------------------------------------------------------------------
+// vma
+// -----------------------------------------------------------------------------
+
+static_assert(sizeof(uintptr_t) == sizeof(uint64_t), "radix assumes 64 bits pointers");
+
+static struct vma *vma_meta(void *ptr, bool alloc)
+{
+    uint64_t key = ((uintptr_t) ptr) / span_len;
+    size_t root = key / radix_leaf_len;
+    size_t leaf = key % radix_leaf_len;
+    assert(root < radix_root_len);
+
+    struct vma *table = atomic_load_explicit(&radix[root], memory_order_acquire);
+    if (unlikely(!table)) {
+        if (!alloc) return NULL;
+
+        size_t len = radix_leaf_len * sizeof(struct vma);
+        struct vma *new = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (new == MAP_FAILED) return NULL;
+
+        if (atomic_compare_exchange_strong(&radix[root], &table, new)) table = new;
+        else munmap(new, len);
     }
 
-    void *ptr = buckets[bucket];
-    buckets[bucket] = (void *) ptr_read_u64(ptr);
-    return ptr;
+    return &table[leaf];
 }
 
-static void bucket_free(size_t bucket, void *ptr)
+// Returns 0 if the length can't be mapped.
+static size_t vma_class_len(size_t len)
+{
+    if (len > SIZE_MAX / 2) return 0;
+
+    size_t vma_len = align_up(len ? len : 1, page_len);
+    if (vma_len >= span_len) return align_up(vma_len, span_len);
+    return 1UL << (64 - __builtin_clzl(vma_len - 1));
+}
+
+static inline size_t vma_cache_bin(size_t vma_len)
+{
+    if (vma_len < span_len) return __builtin_ctzl(vma_len / page_len);
+    return vma_small_classes + vma_len / span_len - 1;
+}
+
+static inline size_t vma_cache_bin_len(size_t bin)
+{
+    if (bin < vma_small_classes) return page_len << bin;
+    return (bin - vma_small_classes + 1) * span_len;
+}
+
+static void vma_cache_unlink(struct vma *vma)
+{
+    size_t bin = vma_cache_bin(vma->len);
+
+    if (vma->prev) vma->prev->next = vma->next;
+    else vma_cache.bins[bin] = vma->next;
+    if (vma->next) vma->next->prev = vma->prev;
+
+    if (vma->lru_prev) vma->lru_prev->lru_next = vma->lru_next;
+    else vma_cache.lru_head = vma->lru_next;
+    if (vma->lru_next) vma->lru_next->lru_prev = vma->lru_prev;
+    else vma_cache.lru_tail = vma->lru_prev;
+
+    vma_cache.len -= vma->len;
+}
+
+// The metadata slot must be cleared before unmapping as the address range can
+// be picked up by another thread as soon as it's released.
+static void vma_unmap(struct vma *vma)
+{
+    void *ptr = vma->ptr;
+    size_t len = vma->len;
+
+    vma->len = 0;
+    munmap(ptr, len);
+}
+
+// Returns the number of bytes released.
+static size_t vma_unmap_list(struct vma *list)
 {
-    ptr_write_u64(ptr, (uint64_t) buckets[bucket]);
-    buckets[bucket] = ptr;
+    size_t released = 0;
+
+    while (list) {
+        struct vma *next = list->next;
+        released += list->len;
+        vma_unmap(list);
+        list = next;
+    }
+
+    return released;
+}
+
+// Must be called with the cache lock held. Unlinks the entries that decayed or
+// that don't fit under the cap and returns them as a list to be unmapped once
+// the lock is released.
+static struct vma *vma_cache_evict(uint64_t now, size_t cap)
+{
+    struct vma *evicted = NULL;
+
+    while (vma_cache.lru_tail) {
+        struct vma *tail = vma_cache.lru_tail;
+        bool expired = now - tail->time >= vma_cache_decay;
+        if (vma_cache.len <= cap && !expired) break;
+
+        vma_cache_unlink(tail);
+        tail->next = evicted;
+        evicted = tail;
+    }
+
+    return evicted;
+}
+
+// Expired entries are evicted on the way so that they're not handed out and so
+// that a process which only allocates still returns them to the OS. The vma
+// returned can be longer than requested.
+static struct vma *vma_cache_get(size_t vma_len)
+{
+    size_t bin = vma_cache_bin(vma_len);
+    if (bin >= vma_cache_bins) return NULL;
+
+    uint64_t now = clock_ms();
+    pmem_lock(&vma_cache.lock);
+
+    struct vma *evicted = vma_cache_evict(now, vma_cache_cap);
+
+    struct vma *vma = NULL;
+    for (; !vma && bin < vma_cache_bins; ++bin) {
+        if (vma_cache_bin_len(bin) > vma_len * vma_cache_slack) break;
+        vma = vma_cache.bins[bin];
+    }
+    if (vma) vma_cache_unlink(vma);
+
+    pmem_unlock(&vma_cache.lock);
+
+    vma_unmap_list(evicted);
+    return vma;
+}
+
+// Returns false if the vma wasn't cached and must be unmapped by the caller.
+// Evicted entries are unmapped outside of the lock.
+static bool vma_cache_put(struct vma *vma)
+{
+    size_t bin = vma_cache_bin(vma->len);
+    if (bin >= vma_cache_bins) return false;
+    if (vma->len > vma_cache_cap) return false;
+
+    uint64_t now = clock_ms();
+    pmem_lock(&vma_cache.lock);
+
+    vma->time = now;
+    vma->prev = NULL;
+    vma->next = vma_cache.bins[bin];
+    if (vma->next) vma->next->prev = vma;
+    vma_cache.bins[bin] = vma;
+
+    vma->lru_prev = NULL;
+    vma->lru_next = vma_cache.lru_head;
+    if (vma->lru_next) vma->lru_next->lru_prev = vma;
+    else vma_cache.lru_tail = vma;
+    vma_cache.lru_head = vma;
+
+    vma_cache.len += vma->len;
+    struct vma *evicted = vma_cache_evict(now, vma_cache_cap);
+
+    pmem_unlock(&vma_cache.lock);
+
+    vma_unmap_list(evicted);
+    return true;
+}
+
+// Evicts everything if forced or only the entries that decayed otherwise.
+// Returns the number of bytes released.
+static size_t vma_cache_purge(bool force)
+{
+    uint64_t now = clock_ms();
+
+    pmem_lock(&vma_cache.lock);
+    struct vma *evicted = vma_cache_evict(now, force ? 0 : vma_cache_cap);
+    pmem_unlock(&vma_cache.lock);
+
+    return vma_unmap_list(evicted);
+}
+
+// vma are always aligned on the span length so only alignments above that
+// require special handling and those bypass the cache.
+static void *vma_alloc_aligned(size_t len, size_t align)
+{
+    size_t vma_len = vma_class_len(len);
+    if (!vma_len) return NULL;
+    if (align < span_len) align = span_len;
+
+    struct vma *vma = align == span_len ? vma_cache_get(vma_len) : NULL;
+    if (!vma) {
+        void *ptr = mmap_aligned(vma_len, align, PROT_READ | PROT_WRITE);
+        if (!ptr) return NULL;
+
+        vma = vma_meta(ptr, true);
+        if (!vma) { munmap(ptr, vma_len); return NULL; }
+
+        vma->ptr = ptr;
+        vma->len = vma_len;
+    }
+
+    vma->tag = 0;
+    vma->requested = len;
+    atomic_fetch_add_explicit(&vma_live.count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&vma_live.bytes, vma->len, memory_order_relaxed);
+    atomic_fetch_add_explicit(&vma_live.requested, len, memory_order_relaxed);
+    return vma->ptr;
+}
+
+static void *vma_alloc(size_t len)
+{
+    return vma_alloc_aligned(len, span_len);
+}
+
+static void vma_free(void *ptr)
+{
+    struct vma *vma = vma_meta(ptr, false);
+    atomic_fetch_sub_explicit(&vma_live.count, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&vma_live.bytes, vma->len, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&vma_live.requested, vma->requested, memory_order_relaxed);
+    if (!vma_cache_put(vma)) vma_unmap(vma);
+}
+
+static size_t vma_usable_size(void *ptr)
+{
+    return vma_meta(ptr, false)->len;
+}
+
+static void vma_requested(struct vma *vma, size_t len)
+{
+    atomic_fetch_add_explicit(&vma_live.requested, len - vma->requested, memory_order_relaxed);
+    vma->requested = len;
+}
+
+// Resizes in place if possible or otherwise moves the pages to a cached vma or
+// to a new span aligned reservation. Either way the kernel takes care of moving
+// the pages so no copies are involved.
+static void *vma_remap(void *ptr, size_t len)
+{
+    struct vma *vma = vma_meta(ptr, false);
+
+    size_t vma_len = vma_class_len(len);
+    if (!vma_len) return NULL;
+    if (vma_len == vma->len) { vma_requested(vma, len); return ptr; }
+
+    if (mremap(ptr, vma->len, vma_len, 0) != MAP_FAILED) {
+        atomic_fetch_add_explicit(&vma_live.bytes, vma_len - vma->len, memory_order_relaxed);
+        vma->len = vma_len;
+        vma_requested(vma, len);
+        return ptr;
+    }
+
+    // Pages of a cached vma past vma_len are left mapped and kept as headroom.
+    struct vma *new_vma = vma_cache_get(vma_len);
+    if (!new_vma) {
+        void *target = mmap_aligned(vma_len, span_len, PROT_NONE);
+        if (!target) return NULL;
+
+        new_vma = vma_meta(target, true);
+        if (!new_vma) { munmap(target, vma_len); return NULL; }
+
+        new_vma->ptr = target;
+        new_vma->len = vma_len;
+    }
+
+    size_t old_len = vma->len;
+    vma->len = 0;
+
+    void *new = mremap(ptr, old_len, vma_len, MREMAP_MAYMOVE | MREMAP_FIXED, new_vma->ptr);
+    if (new == MAP_FAILED) {
+        vma->len = old_len;
+        vma_unmap(new_vma);
+        return NULL;
+    }
+
+    new_vma->tag = vma->tag;
+    new_vma->requested = vma->requested;
+    vma_requested(new_vma, len);
+
+    atomic_fetch_add_explicit(&vma_live.bytes, new_vma->len - old_len, memory_order_relaxed);
+    return new;
 }
 
 
 // -----------------------------------------------------------------------------
-// mem
+// cache
 // -----------------------------------------------------------------------------
 
-static void *mem_alloc_impl(size_t len)
+// Each thread keeps a free list per size class which is refilled from and
+// flushed back to the global buckets in batches. This keeps the bucket locks
+// off the common path. Blocks freed by a thread other than the one that
+// allocated them simply end up in the freeing thread's cache which is fine
+// since the global buckets don't track ownership.
+
+enum cache_state { cache_uninit = 0, cache_active, cache_dead };
+
+struct cache_bucket
+{
+    void *head;
+    size_t len;
+};
+
+struct cache
 {
-   size_t bucket = len_to_bucket(len);
-   return bucket == bucket_vma ? vma_alloc(len) : bucket_alloc(bucket);
+    enum cache_state state;
+    struct cache_bucket buckets[bucket_count];
+};
+
+static __thread struct cache cache = {0};
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static size_t cache_batch(size_t bucket)
+{
+    size_t batch = cache_batch_bytes / bucket_to_len(bucket);
+    if (batch < 2) return 2;
+    if (batch > 64) return 64;
+    return batch;
 }
 
-static void mem_free_impl(void *ptr)
+static bool cache_refill(size_t bucket)
 {
-    size_t bucket = ptr_to_bucket(ptr);
-    bucket == bucket_vma ? vma_free(ptr) : bucket_free(bucket, ptr);
+    struct cache_bucket *cb = &cache.buckets[bucket];
+    size_t batch = cache_batch(bucket);
+
+    pmem_lock(&buckets[bucket].lock);
+
+    for (size_t i = 0; i < batch; ++i) {
+        void *ptr = bucket_alloc(bucket);
+        if (!ptr) break;
+
+        ptr_write_u64(ptr, (uint64_t) cb->head);
+        cb->head = ptr;
+        cb->len++;
+    }
+
+    pmem_unlock(&buckets[bucket].lock);
+
+    span_purge(false);
+    return cb->head;
 }
 
-static size_t mem_usable_size_impl(void *ptr)
+static void cache_flush(size_t bucket, size_t len)
 {
-    size_t bucket = ptr_to_bucket(ptr);
-    return bucket == bucket_vma ? vma_usable_size(ptr) : bucket_to_len(bucket);
+    struct cache_bucket *cb = &cache.buckets[bucket];
+    if (len > cb->len) len = cb->len;
+    if (!len) return;
+
+    pmem_lock(&buckets[bucket].lock);
+
+    for (size_t i = 0; i < len; ++i) {
+        void *ptr = cb->head;
+        cb->head = (void *) ptr_read_u64(ptr);
+        bucket_free(bucket, ptr);
+    }
+
+    pmem_unlock(&buckets[bucket].lock);
+
+    cb->len -= len;
+    span_purge(false);
+}
+
+static void cache_exit(void *data)
+{
+    (void) data;
+
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+        cache_flush(bucket, cache.buckets[bucket].len);
+
+    // Other TLS destructors might still call free after us so any subsequent
+    // operations must bypass the cache.
+    cache.state = cache_dead;
+}
+
+static void cache_key_init(void)
+{
+    int ret = pthread_key_create(&cache_key, cache_exit);
+    assert(!ret); (void) ret;
 }
 
+static bool cache_active_check(void)
+{
+    if (likely(cache.state == cache_active)) return true;
+    if (cache.state == cache_dead) return false;
+
+    // Registering the key value is what gets cache_exit called on thread
+    // exit. The state is flipped first as pthread_setspecific may allocate.
+    pthread_once(&cache_once, cache_key_init);
+    cache.state = cache_active;
+    pthread_setspecific(cache_key, &cache);
+    return true;
+}
 
-void *mem_alloc(size_t len)
+static void *cache_alloc(size_t bucket)
 {
-    pmem_lock(&mem_lock);
-    void *ptr = mem_alloc_impl(len);
-    pmem_unlock(&mem_lock);
+    if (!cache_active_check()) {
+        pmem_lock(&buckets[bucket].lock);
+        void *ptr = bucket_alloc(bucket);
+        pmem_unlock(&buckets[bucket].lock);
+        return ptr;
+    }
+
+    struct cache_bucket *cb = &cache.buckets[bucket];
+    if (unlikely(!cb->head) && !cache_refill(bucket)) return NULL;
+
+    void *ptr = cb->head;
+    cb->head = (void *) ptr_read_u64(ptr);
+    cb->len--;
     return ptr;
 }
 
+static void cache_free(size_t bucket, void *ptr)
+{
+    if (!cache_active_check()) {
+        pmem_lock(&buckets[bucket].lock);
+        bucket_free(bucket, ptr);
+        pmem_unlock(&buckets[bucket].lock);
+
+        span_purge(false);
+        return;
+    }
+
+    struct cache_bucket *cb = &cache.buckets[bucket];
+    ptr_write_u64(ptr, (uint64_t) cb->head);
+    cb->head = ptr;
+    cb->len++;
+
+    size_t batch = cache_batch(bucket);
+    if (unlikely(cb->len >= batch * 2)) cache_flush(bucket, batch);
+}
+
+
+// -----------------------------------------------------------------------------
+// mem
+// -----------------------------------------------------------------------------
+
+void *mem_alloc(size_t len)
+{
+    size_t bucket = len_to_bucket(len);
+    return bucket == bucket_vma ? vma_alloc(len) : cache_alloc(bucket);
+}
+
+// Blocks start on a page boundary within their span so any class whose length
+// is a multiple of the alignment only hands out aligned blocks. The power of 2
+// classes guarantee that we find one for any alignment up to the page size.
+void *mem_alloc_aligned(size_t align, size_t len)
+{
+    assert(align && !(align & (align - 1)));
+    if (align <= 16) return mem_alloc(len);
+
+    if (align <= page_len) {
+        size_t bucket = len_to_bucket(len);
+        for (; bucket < bucket_count; ++bucket) {
+            if (bucket_to_len(bucket) % align) continue;
+            return cache_alloc(bucket);
+        }
+    }
+
+    return vma_alloc_aligned(len, align);
+}
+
 void *mem_calloc(size_t n, size_t len)
 {
     void *ptr = mem_alloc(n * len);
-    memset(ptr, 0, n * len);
+    if (ptr) memset(ptr, 0, n * len);
     return ptr;
 }
 
@@ -172,28 +871,152 @@ void mem_free(void *ptr)
 {
     if (!ptr) return;
 
-    pmem_lock(&mem_lock);
-    mem_free_impl(ptr);
-    pmem_unlock(&mem_lock);
+    size_t bucket = ptr_to_bucket(ptr);
+    bucket == bucket_vma ? vma_free(ptr) : cache_free(bucket, ptr);
 }
 
+static void *mem_realloc_move(void *ptr, size_t old_len, size_t len)
+{
+    void *new = mem_alloc(len);
+    if (!new) return NULL;
+
+    memcpy(new, ptr, old_len < len ? old_len : len);
+    mem_free(ptr);
+
+    return new;
+}
 
+// Blocks are kept in place whenever the new length still fits and isn't so
+// small that a smaller size class would halve the footprint. vma blocks are
+// resized through mremap which lets the kernel move the pages around instead
+// of copying them.
 void *mem_realloc(void *ptr, size_t len)
 {
-    pmem_lock(&mem_lock);
+    size_t bucket = ptr_to_bucket(ptr);
 
-    void *new = mem_alloc_impl(len);
-    memcpy(new, ptr, mem_usable_size_impl(ptr));
-    mem_free_impl(ptr);
+    if (bucket != bucket_vma) {
+        size_t old_len = bucket_to_len(bucket);
+        if (len <= old_len && len > old_len / 2) return ptr;
+        return mem_realloc_move(ptr, old_len, len);
+    }
 
-    pmem_unlock(&mem_lock);
-    return new;
+    if (len_to_bucket(len) != bucket_vma)
+        return mem_realloc_move(ptr, vma_usable_size(ptr), len);
+
+    return vma_remap(ptr, len);
 }
 
+// Span headers and vma metadata are stable for as long as the block is live so
+// no locking is required here.
 size_t mem_usable_size(void *ptr)
 {
-    pmem_lock(&mem_lock);
-    size_t len = mem_usable_size_impl(ptr);
-    pmem_unlock(&mem_lock);
-    return len;
+    size_t bucket = ptr_to_bucket(ptr);
+    return bucket == bucket_vma ? vma_usable_size(ptr) : bucket_to_len(bucket);
+}
+
+size_t mem_trim(void)
+{
+    return span_purge(true) + vma_cache_purge(true);
+}
+
+// Releases whatever outlived its decay. Meant to be called periodically so that
+// an idle process doesn't hold on to memory it freed.
+void mem_decay(void)
+{
+    span_purge(false);
+    vma_cache_purge(false);
+}
+
+
+// -----------------------------------------------------------------------------
+// stats
+// -----------------------------------------------------------------------------
+
+static_assert((size_t) pmem_stats_classes == bucket_count, "stats classes out of sync");
+
+void mem_stats(struct pmem_stats *stats)
+{
+    stats->span_len = span_len;
+
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+        struct bucket *b = &buckets[bucket];
+        pmem_lock(&b->lock);
+
+        stats->classes[bucket] = (struct pmem_stats_class) {
+            .len = bucket_to_len(bucket),
+            .spans = b->spans,
+            .empty = b->spans_empty,
+            .used = b->used,
+            .free = b->free,
+        };
+
+        pmem_unlock(&b->lock);
+    }
+
+    stats->vma_count = atomic_load_explicit(&vma_live.count, memory_order_relaxed);
+    stats->vma_bytes = atomic_load_explicit(&vma_live.bytes, memory_order_relaxed);
+    stats->vma_requested = atomic_load_explicit(&vma_live.requested, memory_order_relaxed);
+
+    pmem_lock(&vma_cache.lock);
+    stats->vma_cached = vma_cache.len;
+    pmem_unlock(&vma_cache.lock);
+}
+
+
+// -----------------------------------------------------------------------------
+// tag
+// -----------------------------------------------------------------------------
+
+// Tags are opaque 64 bits values attached to a block for as long as it's live.
+// They're not reset by the allocator so they must be cleared before the block
+// is freed which mem_tag_take takes care of.
+
+void mem_tag_set(void *ptr, uint64_t tag)
+{
+    size_t bucket = ptr_to_bucket(ptr);
+    if (bucket == bucket_vma) vma_meta(ptr, false)->tag = tag;
+    else *span_tag(ptr_to_span(ptr), ptr) = tag;
+}
+
+uint64_t mem_tag_take(void *ptr)
+{
+    size_t bucket = ptr_to_bucket(ptr);
+    uint64_t *slot = bucket == bucket_vma ?
+        &vma_meta(ptr, false)->tag : span_tag(ptr_to_span(ptr), ptr);
+
+    // Avoids dirtying the page when there's nothing to clear.
+    uint64_t tag = *slot;
+    if (tag) *slot = 0;
+    return tag;
+}
+
+
+// -----------------------------------------------------------------------------
+// fork
+// -----------------------------------------------------------------------------
+
+// The locks are never held while taking another one of them so any order
+// works. Thread caches of the threads that don't survive the fork are leaked.
+
+void mem_fork_prepare(void)
+{
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+        pmem_lock(&buckets[bucket].lock);
+    pmem_lock(&vma_cache.lock);
+}
+
+void mem_fork_parent(void)
+{
+    pmem_unlock(&vma_cache.lock);
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+        pmem_unlock(&buckets[bucket].lock);
+}
+
+// Waiters of the parent don't exist in the child so the locks are reset rather
+// than unlocked.
+void mem_fork_child(void)
+{
+    vma_cache.lock = 0;
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket)
+        buckets[bucket].lock = 0;
 }
@@ -1,5 +1,8 @@
+#include <time.h>
 #include <errno.h>
+#include <malloc.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/syscall.h>
 #include <linux/futex.h>
 
@@ -11,17 +14,25 @@
 // -----------------------------------------------------------------------------
 
 // linux is fucking stupid sometimes...
-static inline int futex(atomic_int *uaddr, int futex_op, int val)
+static inline int futex(
+        atomic_int *uaddr, int futex_op, int val, const struct timespec *timeout)
 {
-    return syscall(SYS_futex, (int *) uaddr, futex_op, val, NULL, 0, 0);
+    return syscall(SYS_futex, (int *) uaddr, futex_op, val, timeout, 0, 0);
 }
 
+// Based on mutex2 from Ulrich Drepper's "Futexes Are Tricky": 0 is unlocked, 1
+// is locked and 2 is locked with waiters. Only the last state requires a
+// syscall on unlock which keeps uncontended locks entirely in userspace.
+
 void pmem_lock(lock_t *lock)
 {
     int exp = 0;
-    while (!atomic_compare_exchange_strong(lock, &exp, 1)) {
-        futex(lock, FUTEX_WAIT, 1);
-        exp = 0;
+    if (atomic_compare_exchange_strong(lock, &exp, 1)) return;
+
+    if (exp != 2) exp = atomic_exchange(lock, 2);
+    while (exp) {
+        futex(lock, FUTEX_WAIT, 2, NULL);
+        exp = atomic_exchange(lock, 2);
     }
 }
 
@@ -33,8 +44,54 @@ bool pmem_try_lock(lock_t *lock)
 
 void pmem_unlock(lock_t *lock)
 {
+    if (atomic_fetch_sub(lock, 1) == 1) return;
+
     atomic_store(lock, 0);
-    futex(lock, FUTEX_WAKE, 1);
+    futex(lock, FUTEX_WAKE, 1, NULL);
+}
+
+void pmem_wait(atomic_int *word, int value, uint64_t timeout)
+{
+    struct timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000 };
+    futex(word, FUTEX_WAIT, value, timeout ? &ts : NULL);
+}
+
+void pmem_wake(atomic_int *word)
+{
+    futex(word, FUTEX_WAKE, 1, NULL);
+}
+
+
+// -----------------------------------------------------------------------------
+// fork
+// -----------------------------------------------------------------------------
+
+// prof's locks are taken first as they're held while allocating from mem. The
+// handlers are registered when the library is loaded such that the ones of the
+// program, registered later, run before ours on prepare and can still allocate.
+
+static void fork_prepare(void)
+{
+    prof_fork_prepare();
+    mem_fork_prepare();
+}
+
+static void fork_parent(void)
+{
+    mem_fork_parent();
+    prof_fork_parent();
+}
+
+static void fork_child(void)
+{
+    mem_fork_child();
+    prof_fork_child();
+}
+
+__attribute__((constructor))
+static void fork_init(void)
+{
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
 }
 
 
@@ -45,14 +102,14 @@ void pmem_unlock(lock_t *lock)
 pmem_public void *malloc(size_t size)
 {
     void *ptr = mem_alloc(size);
-    prof_alloc(ptr, size);
+    if (ptr) prof_alloc(ptr, size);
     return ptr;
 }
 
 pmem_public void *calloc(size_t nmemb, size_t size)
 {
     void *ptr = mem_calloc(nmemb, size);
-    prof_alloc(ptr, nmemb * size);
+    if (ptr) prof_alloc(ptr, nmemb * size);
     return ptr;
 }
 
@@ -61,9 +118,12 @@ pmem_public void *realloc(void *old, size_t size)
     if (!old) return malloc(size);
     if (!size) { free(old); return NULL; }
 
+    // The block is re-registered even if it didn't move as the allocation
+    // source is most likely different.
     prof_free(old);
     void *new = mem_realloc(old, size);
-    prof_alloc(new, size);
+    if (new) prof_alloc(new, size);
+    else prof_alloc(old, mem_usable_size(old));
     return new;
 }
 
@@ -79,38 +139,119 @@ pmem_public void free(void *ptr)
 // extended
 // -----------------------------------------------------------------------------
 
-static inline size_t align(size_t align, size_t size)
+static inline bool is_pow2(size_t value)
 {
-    return (size + (align - 1)) & ~(align - 1);
+    return value && !(value & (value - 1));
+}
+
+static void *alloc_aligned(size_t alignment, size_t size)
+{
+    void *ptr = mem_alloc_aligned(alignment, size);
+    if (ptr) prof_alloc(ptr, size);
+    return ptr;
 }
 
 pmem_public int posix_memalign(void **memptr, size_t alignment, size_t size)
 {
-    *memptr = malloc(align(alignment, size));
-    return *memptr ? 0 : ENOMEM;
+    if (!is_pow2(alignment) || alignment % sizeof(void *)) return EINVAL;
+
+    void *ptr = alloc_aligned(alignment, size);
+    if (!ptr) return ENOMEM;
+
+    *memptr = ptr;
+    return 0;
 }
 
 pmem_public void *aligned_alloc(size_t alignment, size_t size)
 {
-    return malloc(align(alignment, size));
+    if (!is_pow2(alignment)) { errno = EINVAL; return NULL; }
+    return alloc_aligned(alignment, size);
 }
 
 pmem_public void *memalign(size_t alignment, size_t size)
 {
-    return malloc(align(alignment, size));
+    if (!is_pow2(alignment)) { errno = EINVAL; return NULL; }
+    return alloc_aligned(alignment, size);
 }
 
 pmem_public void *valloc(size_t size)
 {
-    return memalign(sysconf(_SC_PAGE_SIZE), size);
+    return alloc_aligned(sysconf(_SC_PAGE_SIZE), size);
 }
 
 pmem_public void *pvalloc(size_t size)
 {
-    return malloc(align(size, sysconf(_SC_PAGE_SIZE)));
+    size_t page = sysconf(_SC_PAGE_SIZE);
+    return alloc_aligned(page, (size + (page - 1)) & ~(page - 1));
 }
 
 pmem_public size_t malloc_usable_size(void *ptr)
 {
     return mem_usable_size(ptr);
 }
+
+// Releases all the empty spans and cached vma regardless of the decay policy.
+// pad is ignored as there's no heap top to trim.
+pmem_public int malloc_trim(size_t pad)
+{
+    (void) pad;
+    return mem_trim() > 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// stats
+// -----------------------------------------------------------------------------
+
+pmem_public void pmem_stats(struct pmem_stats *stats)
+{
+    mem_stats(stats);
+    prof_stats(stats);
+}
+
+// Spans play the role of glibc's arena and vma allocations of its mmapped
+// chunks. keepcost is what malloc_trim would release: the empty spans and the
+// vma cache.
+pmem_public struct mallinfo2 mallinfo2(void)
+{
+    struct pmem_stats stats = {0};
+    pmem_stats(&stats);
+
+    struct mallinfo2 info = {
+        .hblks = stats.vma_count,
+        .hblkhd = stats.vma_bytes,
+        .keepcost = stats.vma_cached,
+    };
+
+    for (size_t i = 0; i < pmem_stats_classes; ++i) {
+        const struct pmem_stats_class *class = &stats.classes[i];
+        info.arena += class->spans * stats.span_len;
+        info.ordblks += class->free;
+        info.uordblks += class->used * class->len;
+        info.keepcost += class->empty * stats.span_len;
+    }
+
+    info.fordblks = info.arena - info.uordblks;
+    return info;
+}
+
+// Written straight to stderr like glibc's version.
+pmem_public void malloc_stats(void)
+{
+    struct pmem_stats stats = {0};
+    pmem_stats(&stats);
+
+    fprintf(stderr, "%5s %6s %6s %10s %10s\n", "class", "spans", "empty", "used", "free");
+
+    for (size_t i = 0; i < pmem_stats_classes; ++i) {
+        const struct pmem_stats_class *class = &stats.classes[i];
+        if (!class->spans) continue;
+
+        fprintf(stderr, "%5zu %6zu %6zu %10zu %10zu\n",
+                class->len, class->spans, class->empty, class->used, class->free);
+    }
+
+    fprintf(stderr, "vma: count=%zu, bytes=%zu, requested=%zu, cached=%zu\n",
+            stats.vma_count, stats.vma_bytes, stats.vma_requested, stats.vma_cached);
+    fprintf(stderr, "prof: sources=%zu, bytes=%zu\n", stats.sources, stats.prof_bytes);
+}
@@ -1,8 +1,13 @@
 #include "common.h"
 
+#include <math.h>
+#include <time.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -11,38 +16,261 @@
 // -----------------------------------------------------------------------------
 
 
-struct frame
-{
-    char name[128];
-    uint64_t off;
-};
+// Ids of the symbols and stacks already written to the current binary file.
+// Ids from a previous file (ie. before a fork) are detected by their generation.
+struct bin_id { uint32_t gen, id; };
+
+// Log2 histograms of the requested lengths and of the lifetimes in
+// milliseconds where bucket i counts values in [2^(i-1), 2^i) and bucket 0
+// counts zeros. The last bucket also holds everything larger.
+enum { hist_len = 32 };
 
+struct counter { atomic_size_t total; size_t prev; };
+
+static_assert(PMEM_LIFETIME_SHORT && !(PMEM_LIFETIME_SHORT & (PMEM_LIFETIME_SHORT - 1)),
+        "PMEM_LIFETIME_SHORT must be a power of 2");
+
+// Histogram bucket of PMEM_LIFETIME_SHORT; lower buckets are short-lived.
+static const size_t lifetime_short = 64 - __builtin_clzl(PMEM_LIFETIME_SHORT);
+
+// Sources only store the raw instruction pointers of their backtrace which are
+// symbolized lazily when dumping. Bytes are counted using the usable size of
+// the blocks as it's the only length that can be recovered when freeing.
 struct source
 {
     uint64_t hash;
-    struct { size_t total, prev; } alloc, free;
+    struct { struct counter count, bytes; } alloc, free;
+    atomic_size_t sizes[hist_len], lifetimes[hist_len];
+    uint32_t id;
+
+    // Live bytes of the last top_window + 1 snapshots such that the growth spans
+    // top_window intervals. Only touched by the dumper.
+    size_t window[PMEM_TOP_WINDOW + 1];
+    struct bin_id bin;
 
     size_t len;
-    struct frame bt[];
+    uint64_t ips[];
 };
 
-// Used to protect the prof htables.
-static lock_t prof_lock = 0;
+// Names point into the interned string table and are shared by all the
+// symbols of a function.
+struct symbol
+{
+    const char *name;
+    uint64_t off;
+    struct bin_id bin;
+};
+
+enum { bt_cap = PMEM_MAX_DEPTH };
+
+static_assert(PMEM_TOP_WINDOW > 0, "PMEM_TOP_WINDOW must be at least 1");
+static size_t top_n = PMEM_TOP_N;
+static const size_t top_window = PMEM_TOP_WINDOW;
+
+// Dumps are done by a dedicated thread which is started on the first trigger
+// and woken up through dump_pending. If the thread can't be started, the
+// triggering thread does the dump itself. dump_lock ensures that there's only a
+// single dump running and is used in a non-blocking fashion by the fallback
+// (ie. if locked, skip dumping).
+enum dumper_state { dumper_idle = 0, dumper_running, dumper_failed };
 
-// Used to ensure that we only have a single dumper running. This is usually
-// used in a non-blocking fashion (ie. if locked, skip dumping).
 static lock_t dump_lock = 0;
+static lock_t dumper_lock = 0;
+static atomic_int dumper_state = dumper_idle;
+
+// Mask of the triggers that fired since the last dump which is also the word
+// that the dumper waits on. The timer and signal triggers require the dumper
+// to be running before anything else fires so it's started eagerly.
+enum trigger
+{
+    trigger_churn = 1 << 0,
+    trigger_timer = 1 << 1,
+    trigger_signal = 1 << 2,
+    trigger_hwm = 1 << 3,
+};
+
+static atomic_int dump_pending = 0;
+static bool dumper_eager = false;
+
+static const uint64_t dumper_tick =
+    PMEM_SPAN_DECAY < PMEM_VMA_CACHE_DECAY ? PMEM_SPAN_DECAY : PMEM_VMA_CACHE_DECAY;
+
+// Counters are copied into the snapshot before formatting such that the output
+// is consistent and the sources are only read once. Sources with nothing live
+// that didn't change since the previous snapshot are skipped. Only accessed
+// while holding dump_lock.
+struct snapshot_counter { size_t curr, total; };
+
+struct snapshot_entry
+{
+    struct source *source;
+    struct { struct snapshot_counter count, bytes; } alloc, free;
+    size_t sizes[hist_len], lifetimes[hist_len];
+    int64_t growth;
+};
+
+// The formats write the entries listed in selected which is filled by
+// dump_select. The state of the allocator is read from the counters that it
+// maintains along with the RSS of the process.
+static struct
+{
+    size_t index, churn;
+    int trigger;
+    size_t rss;
+    struct pmem_stats heap;
+
+    size_t len, cap;
+    struct snapshot_entry *entries;
+
+    size_t selected_len;
+    struct snapshot_entry **selected;
+} snapshot = {0};
+
+// Bounded min-heaps used to select the top entries without sorting them all.
+// Items are allocated on the first selection as top_n is only known at runtime.
+struct top
+{
+    size_t len;
+    struct { int64_t key; struct snapshot_entry *entry; } *items;
+};
+
+enum format { format_unknown = 0, format_text, format_bin, format_pprof, format_collapsed };
+
+// Runtime configuration which defaults to config.h and can be overridden by the
+// environment variables of the same name when the library is loaded.
+static bool prof_enabled = PMEM_PROFILE;
+static enum format dump_format = format_unknown;
+static char dump_path[256] = PMEM_PATH;
+static uint64_t dump_period = PMEM_PERIOD;
+static int dump_signal = PMEM_SIGNAL;
+
+// State of the binary file which is truncated the first time it's opened by a
+// process. Only accessed while holding dump_lock.
+static struct
+{
+    pid_t pid;
+    uint32_t gen;
+    uint32_t symbols, stacks;
+} bin = {0};
 
 // This flag is used to ignore profiling allocations made by the profiler which
 // also avoids re-entrency issues.
 static __thread bool profiling = 0;
 
-// Policy for when to dump.
+// Policy for when to dump. Threads accumulate churn locally and only add it to
+// the global counter once it goes over churn_local_thresh which keeps the
+// trigger accurate to within churn_local_thresh bytes per thread.
 static atomic_size_t churn = 0;
-static const size_t churn_thresh = PMEM_CHURN_THRESH;
+static size_t churn_thresh = PMEM_CHURN_THRESH;
+static size_t churn_local_thresh = PMEM_CHURN_THRESH / 64;
+
+// Live bytes of the whole heap, sampled or not, are accumulated the same way
+// and a dump is triggered every time they go over the high-water mark by
+// hwm_step which then becomes the new mark. Allocations made by the profiler
+// aren't counted.
+static atomic_int_fast64_t live = 0;
+static atomic_int_fast64_t live_hwm = 0;
+static size_t hwm_step = PMEM_HWM_STEP;
+static const int64_t live_local_thresh = 64 * 1024;
+
+// Source counter deltas are accumulated per thread in a small direct mapped
+// table and merged into the sources on eviction, when dumping and on thread
+// exit. The lock is only contended while the dumper is merging.
+enum { stats_slots = 64 };
+
+struct delta
+{
+    size_t alloc, free;
+    size_t alloc_bytes, free_bytes;
+    size_t sizes[hist_len], lifetimes[hist_len];
+};
+
+struct stats
+{
+    lock_t lock;
+    size_t churn;
+    int64_t live;
+    struct stats *next, *prev;
+
+    struct
+    {
+        struct source *source;
+        struct delta delta;
+    } slots[stats_slots];
+};
+
+enum stats_state { stats_uninit = 0, stats_active, stats_dead };
+
+static __thread enum stats_state stats_state = stats_uninit;
+static __thread struct stats *stats_local = NULL;
+
+static lock_t stats_lock = 0;
+static struct stats *stats_list = NULL;
+static pthread_key_t stats_key;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+// Sources are never removed so the table can be read without locking. Inserts
+// are serialized through sources_lock and growing the table publishes a new
+// copy while the old one is retired but never freed as readers might still be
+// walking it. Retired tables add up to at most the size of the current one.
+struct source_table
+{
+    size_t len, cap;
+    _Atomic(struct source *) slots[];
+};
 
-static struct htable live = {0};
-static struct htable sources = {0};
+static lock_t sources_lock = 0;
+static _Atomic(struct source_table *) sources = NULL;
+
+// The tag of a sampled block packs the id of its source along with its
+// allocation time which is used to compute its lifetime once freed. Ids start
+// at 1 as a tag of 0 means that the block wasn't sampled. Ids are assigned
+// while holding sources_lock and index chunks that are never freed.
+enum { source_id_chunk = 4096, source_id_chunks = 1024 };
+
+static uint32_t source_ids_len = 0;
+static _Atomic(struct source **) source_ids[source_id_chunks] = {0};
+
+// Once the ids run out, every new backtrace is folded into a single overflow
+// source with an empty stack and a reserved id such that its frees are still
+// attributed. No sources are created after it.
+static const uint32_t source_id_overflow = source_id_chunk * source_id_chunks;
+static const uint64_t source_overflow_hash = -1UL;
+static _Atomic(struct source *) source_overflow = NULL;
+
+// Maps instruction pointers to their symbol. Only accessed while holding
+// dump_lock.
+static struct htable symbols = {0};
+
+// Symbol names are interned in chunks which are never freed and indexed by the
+// hash of the name. Names too long to fit comfortably in a chunk get their own
+// allocation. buf is where names are resolved before being interned and grows
+// until the longest name fits. Only accessed while holding dump_lock.
+enum { names_chunk_len = 64 * 1024 };
+
+static struct
+{
+    struct htable index;
+    char *it, *end;
+
+    char *buf;
+    size_t buf_cap;
+} names = {0};
+
+// Counts are kept in fixed point as sampled allocations are weighted by the
+// inverse of their sampling probability which is rarely a whole number.
+enum { weight_shift = 10 };
+static const size_t weight_unit = 1UL << weight_shift;
+static size_t sample_interval = PMEM_SAMPLE_INTERVAL;
+
+static __thread struct
+{
+    uint64_t rng;
+    int64_t countdown;
+} sampler = {0};
+
+// Usable bytes of the blocks allocated by the profiler for its own state.
+static atomic_size_t meta_bytes = 0;
 
 
 // -----------------------------------------------------------------------------
@@ -61,11 +289,48 @@ static inline uint64_t pun_ptoi(void * value)
     return (union { uint64_t i; void *p; }) { .p = value }.i;
 }
 
+// Allocations made for the profiler's own state which are accounted in
+// meta_bytes. They go straight to mem and are therefore never profiled.
+static void *meta_alloc(size_t len)
+{
+    void *ptr = mem_alloc(len);
+    if (ptr) atomic_fetch_add_explicit(&meta_bytes, mem_usable_size(ptr), memory_order_relaxed);
+    return ptr;
+}
+
+static void *meta_calloc(size_t n, size_t len)
+{
+    void *ptr = mem_calloc(n, len);
+    if (ptr) atomic_fetch_add_explicit(&meta_bytes, mem_usable_size(ptr), memory_order_relaxed);
+    return ptr;
+}
+
+static void meta_free(void *ptr)
+{
+    if (!ptr) return;
+    atomic_fetch_sub_explicit(&meta_bytes, mem_usable_size(ptr), memory_order_relaxed);
+    mem_free(ptr);
+}
+
 
 // -----------------------------------------------------------------------------
 // source
 // -----------------------------------------------------------------------------
 
+// Coarse clocks are read from the vdso without a syscall and the wrap around
+// every 49 days is handled by computing lifetimes with unsigned arithmetic.
+static inline uint32_t clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t tag_pack(uint32_t id, uint32_t time)
+{
+    return (uint64_t) time << 32 | id;
+}
+
 static inline uint64_t addr_hash(uint64_t hash, uint64_t addr)
 {
     const uint8_t *data = (uint8_t *) &addr;
@@ -77,199 +342,1571 @@ static inline uint64_t addr_hash(uint64_t hash, uint64_t addr)
     return hash;
 }
 
-#ifdef PMEM_LIBUNWIND
 
-#define UNW_LOCAL_ONLY
-#include <libunwind.h>
+static struct source *source_find(struct source_table *table, uint64_t hash)
+{
+    if (!table) return NULL;
+
+    for (size_t i = 0; i < table->cap; ++i) {
+        size_t index = (hash + i) & (table->cap - 1);
+        struct source *source =
+            atomic_load_explicit(&table->slots[index], memory_order_acquire);
+
+        if (!source) return NULL;
+        if (source->hash == hash) return source;
+    }
+
+    return NULL;
+}
+
+static void source_table_insert(struct source_table *table, struct source *source)
+{
+    for (size_t i = 0;; ++i) {
+        size_t index = (source->hash + i) & (table->cap - 1);
+        if (atomic_load_explicit(&table->slots[index], memory_order_relaxed)) continue;
+
+        atomic_store_explicit(&table->slots[index], source, memory_order_release);
+        table->len++;
+        return;
+    }
+}
+
+// Must be called while holding sources_lock. Keeps the load factor under 50%.
+static struct source_table *source_table_grow(struct source_table *old)
+{
+    if (old && (old->len + 1) * 2 <= old->cap) return old;
+
+    size_t cap = old ? old->cap * 2 : 1024;
+    struct source_table *table =
+        meta_calloc(1, sizeof(*table) + sizeof(table->slots[0]) * cap);
+    table->cap = cap;
+
+    for (size_t i = 0; old && i < old->cap; ++i) {
+        struct source *source = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+        if (source) source_table_insert(table, source);
+    }
+
+    atomic_store_explicit(&sources, table, memory_order_release);
+    return table;
+}
+
+// Must be called while holding sources_lock. Returns false if the source
+// couldn't be given an id.
+static bool source_id_assign(struct source *source)
+{
+    uint32_t id = source_ids_len + 1;
+    size_t chunk = id / source_id_chunk;
+    if (chunk >= source_id_chunks) return false;
+
+    struct source **slots = atomic_load_explicit(&source_ids[chunk], memory_order_relaxed);
+    if (!slots) {
+        slots = meta_calloc(source_id_chunk, sizeof(*slots));
+        if (!slots) return false;
+        atomic_store_explicit(&source_ids[chunk], slots, memory_order_release);
+    }
+
+    slots[id % source_id_chunk] = source;
+    source->id = id;
+    source_ids_len = id;
+    return true;
+}
+
+static struct source *source_by_id(uint32_t id)
+{
+    if (unlikely(id == source_id_overflow))
+        return atomic_load_explicit(&source_overflow, memory_order_acquire);
+
+    struct source **slots =
+        atomic_load_explicit(&source_ids[id / source_id_chunk], memory_order_acquire);
+    return slots[id % source_id_chunk];
+}
+
+static struct source *source_get(const uint64_t *ips, size_t len, uint64_t hash)
+{
+    struct source *source =
+        source_find(atomic_load_explicit(&sources, memory_order_acquire), hash);
+    if (likely(source)) return source;
+
+    source = atomic_load_explicit(&source_overflow, memory_order_acquire);
+    if (unlikely(source)) return source;
+
+    pmem_lock(&sources_lock);
+
+    struct source_table *table = atomic_load_explicit(&sources, memory_order_relaxed);
+    if ((source = source_find(table, hash))) goto done;
+    if ((source = atomic_load_explicit(&source_overflow, memory_order_relaxed))) goto done;
+
+    source = meta_calloc(1, sizeof(*source) + sizeof(source->ips[0]) * len);
+    source->hash = hash;
+    source->len = len;
+    memcpy(source->ips, ips, sizeof(ips[0]) * len);
+
+    if (unlikely(!source_id_assign(source))) {
+        source->hash = source_overflow_hash;
+        source->len = 0;
+        source->id = source_id_overflow;
+        atomic_store_explicit(&source_overflow, source, memory_order_release);
+    }
+
+    table = source_table_grow(table);
+    source_table_insert(table, source);
+
+  done:
+    pmem_unlock(&sources_lock);
+    return source;
+}
+
+
+// -----------------------------------------------------------------------------
+// stats
+// -----------------------------------------------------------------------------
+
+static inline size_t hist_bucket(size_t len)
+{
+    if (!len) return 0;
+    size_t bucket = 64 - __builtin_clzl(len);
+    return bucket < hist_len ? bucket : hist_len - 1;
+}
+
+// Smallest length counted by the bucket.
+static inline size_t hist_min(size_t bucket)
+{
+    return bucket ? 1UL << (bucket - 1) : 0;
+}
+
+static void hist_add(atomic_size_t *hist, const size_t *delta)
+{
+    for (size_t i = 0; i < hist_len; ++i)
+        if (delta[i]) atomic_fetch_add_explicit(&hist[i], delta[i], memory_order_relaxed);
+}
+
+static inline void counter_add(struct counter *counter, size_t value)
+{
+    if (value) atomic_fetch_add_explicit(&counter->total, value, memory_order_relaxed);
+}
+
+// Adds the delta to the source and resets it.
+static void stats_source_add(struct source *source, struct delta *delta)
+{
+    counter_add(&source->alloc.count, delta->alloc);
+    counter_add(&source->alloc.bytes, delta->alloc_bytes);
+    counter_add(&source->free.count, delta->free);
+    counter_add(&source->free.bytes, delta->free_bytes);
+
+    if (delta->alloc) hist_add(source->sizes, delta->sizes);
+    if (delta->free) hist_add(source->lifetimes, delta->lifetimes);
+
+    memset(delta, 0, sizeof(*delta));
+}
+
+// Must be called while holding the stats' lock.
+static void stats_flush(struct stats *stats)
+{
+    for (size_t i = 0; i < stats_slots; ++i) {
+        if (!stats->slots[i].source) continue;
+        stats_source_add(stats->slots[i].source, &stats->slots[i].delta);
+    }
+}
+
+static void stats_exit(void *data)
+{
+    struct stats *stats = data;
+
+    pmem_lock(&stats_lock);
+    if (stats->prev) stats->prev->next = stats->next;
+    else stats_list = stats->next;
+    if (stats->next) stats->next->prev = stats->prev;
+    pmem_unlock(&stats_lock);
+
+    stats_flush(stats);
+    atomic_fetch_add_explicit(&churn, stats->churn, memory_order_relaxed);
+    atomic_fetch_add_explicit(&live, stats->live, memory_order_relaxed);
+
+    // Frees made by the remaining TLS destructors bypass the local stats.
+    stats_state = stats_dead;
+    stats_local = NULL;
+    meta_free(stats);
+}
 
-static const char frame_unknown[] = "unknown";
-static_assert(sizeof(frame_unknown) < sizeof((struct frame){}.name), "unknown symbol too big");
+static void stats_key_init(void)
+{
+    int ret = pthread_key_create(&stats_key, stats_exit);
+    assert(!ret); (void) ret;
+}
 
-static void source_hash(uint64_t *hash, size_t *len)
+static struct stats *stats_get(void)
 {
-    unw_context_t ctx;
-    unw_getcontext(&ctx);
+    if (likely(stats_state == stats_active)) return stats_local;
+    if (stats_state == stats_dead) return NULL;
+
+    // Flipped first as both pthread_setspecific and meta_calloc may end up
+    // back here through free.
+    stats_state = stats_dead;
+
+    struct stats *stats = meta_calloc(1, sizeof(*stats));
+    if (!stats) return NULL;
 
-    unw_cursor_t cursor;
-    unw_init_local(&cursor, &ctx);
+    pthread_once(&stats_once, stats_key_init);
+    pthread_setspecific(stats_key, stats);
 
-    *len = 0;
-    *hash = 0;
+    pmem_lock(&stats_lock);
+    stats->next = stats_list;
+    if (stats->next) stats->next->prev = stats;
+    stats_list = stats;
+    pmem_unlock(&stats_lock);
+
+    stats_local = stats;
+    stats_state = stats_active;
+    return stats;
+}
+
+// Must be called while holding the stats' lock.
+static struct delta *stats_delta(struct stats *stats, struct source *source)
+{
+    size_t index = (pun_ptoi(source) >> 6) % stats_slots;
 
-    while (unw_step(&cursor) > 0) {
-        unw_word_t ip;
-        unw_get_reg(&cursor, UNW_REG_IP, &ip);
-        *hash = addr_hash(*hash, ip);
-        (*len)++;
+    if (stats->slots[index].source != source) {
+        if (stats->slots[index].source)
+            stats_source_add(stats->slots[index].source, &stats->slots[index].delta);
+        stats->slots[index].source = source;
     }
+
+    return &stats->slots[index].delta;
 }
 
-static void source_bt(struct source *source)
+// Weights are applied to the bytes as well such that they are also unbiased
+// estimates when sampling.
+static void stats_record_alloc(
+        struct source *source, size_t weight, size_t usable, size_t len)
 {
-    unw_context_t ctx;
-    unw_getcontext(&ctx);
+    struct stats *stats = stats_get();
+    if (!stats) {
+        struct delta delta = { .alloc = weight, .alloc_bytes = usable * weight };
+        delta.sizes[hist_bucket(len)] = weight;
+        stats_source_add(source, &delta);
+        return;
+    }
 
-    unw_cursor_t cursor;
-    unw_init_local(&cursor, &ctx);
+    pmem_lock(&stats->lock);
 
-    for (size_t i = 0; unw_step(&cursor) > 0; ++i) {
-        struct frame *frame = &source->bt[i];
+    struct delta *delta = stats_delta(stats, source);
+    delta->alloc += weight;
+    delta->alloc_bytes += usable * weight;
+    delta->sizes[hist_bucket(len)] += weight;
+
+    pmem_unlock(&stats->lock);
+}
 
-        int ret = unw_get_proc_name(&cursor, frame->name, sizeof(frame->name), &frame->off);
-        if (ret == -UNW_ENOINFO) memcpy(frame->name, frame_unknown, sizeof(frame_unknown));
-        else if (ret != -UNW_ENOMEM) assert(!ret);
+static void stats_record_free(
+        struct source *source, size_t weight, size_t usable, uint32_t lifetime)
+{
+    struct stats *stats = stats_get();
+    if (!stats) {
+        struct delta delta = { .free = weight, .free_bytes = usable * weight };
+        delta.lifetimes[hist_bucket(lifetime)] = weight;
+        stats_source_add(source, &delta);
+        return;
     }
+
+    pmem_lock(&stats->lock);
+
+    struct delta *delta = stats_delta(stats, source);
+    delta->free += weight;
+    delta->free_bytes += usable * weight;
+    delta->lifetimes[hist_bucket(lifetime)] += weight;
+
+    pmem_unlock(&stats->lock);
 }
 
-#else
+// Returns the churn to add to the global counter which is 0 until the thread
+// local threshold is crossed. The local churn is only touched by its thread.
+static size_t stats_churn(size_t len)
+{
+    struct stats *stats = stats_get();
+    if (!stats) return len;
+
+    stats->churn += len;
+    if (likely(stats->churn < churn_local_thresh)) return 0;
+
+    len = stats->churn;
+    stats->churn = 0;
+    return len;
+}
 
-#include <execinfo.h>
+// Same as stats_churn but for the live bytes which can go either way.
+static int64_t stats_live(int64_t delta)
+{
+    struct stats *stats = stats_get();
+    if (!stats) return delta;
+
+    stats->live += delta;
+    if (likely(stats->live < live_local_thresh && stats->live > -live_local_thresh))
+        return 0;
+
+    delta = stats->live;
+    stats->live = 0;
+    return delta;
+}
 
-static void source_hash(uint64_t *hash, size_t *len)
+static void stats_merge(void)
 {
-    void *bt[256];
-    *len = backtrace(bt, sizeof(bt) / sizeof(bt[0]));
+    pmem_lock(&stats_lock);
 
-    for (size_t i = 0; i < *len; ++i) {
-        *hash = addr_hash(*hash, (uint64_t) bt[i]);
+    for (struct stats *stats = stats_list; stats; stats = stats->next) {
+        pmem_lock(&stats->lock);
+        stats_flush(stats);
+        pmem_unlock(&stats->lock);
     }
+
+    pmem_unlock(&stats_lock);
+}
+
+
+// -----------------------------------------------------------------------------
+// symbol
+// -----------------------------------------------------------------------------
+
+// The tables allocate through mem so their growth is accounted here.
+static void meta_htable_put(struct htable *ht, uint64_t key, uint64_t value)
+{
+    size_t cap = ht->cap;
+    struct htable_ret ret = htable_put(ht, key, value);
+    assert(ret.ok); (void) ret;
+
+    size_t grown = (ht->cap - cap) * sizeof(*ht->table);
+    atomic_fetch_add_explicit(&meta_bytes, grown, memory_order_relaxed);
+}
+
+// FNV-1a hash implementation: http://isthe.com/chongo/tech/comp/fnv/
+static uint64_t name_hash(const char *str, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < len; ++i)
+        hash = (hash ^ (uint8_t) str[i]) * 0x100000001b3;
+    return hash;
 }
 
-static void source_bt(struct source *source)
+// Hash collisions are resolved by probing the following keys. 0 isn't a valid
+// key so it's skipped.
+static const char *name_intern(const char *str, size_t len)
 {
-    void *bt[256];
-    size_t len = backtrace(bt, sizeof(bt) / sizeof(bt[0]));
-    assert(len == source->len);
+    uint64_t key = name_hash(str, len);
+
+    for (;; key++) {
+        if (!key) continue;
+
+        struct htable_ret ret = htable_get(&names.index, key);
+        if (!ret.ok) break;
+
+        const char *name = pun_itop(ret.value);
+        if (!strncmp(name, str, len) && !name[len]) return name;
+    }
 
-    char **symbols = backtrace_symbols(bt, source->len);
+    char *name = NULL;
+    if (len + 1 > names_chunk_len / 4) name = meta_alloc(len + 1);
+    else {
+        if ((size_t) (names.end - names.it) < len + 1) {
+            names.it = meta_alloc(names_chunk_len);
+            names.end = names.it ? names.it + names_chunk_len : NULL;
+        }
 
-    for (size_t i = 0; i < len; ++i) {
-        struct frame *frame = &source->bt[i];
-        size_t len = strnlen(symbols[i], sizeof(frame->name));
-        memcpy(frame->name, symbols[i], len);
+        name = names.it;
+        if (name) names.it += len + 1;
     }
+    if (!name) return "";
 
-    free(symbols);
+    memcpy(name, str, len);
+    name[len] = '\0';
+
+    meta_htable_put(&names.index, key, pun_ptoi(name));
+    return name;
 }
 
-#endif
+// Names are resolved without truncation by growing the buffer until they fit.
+static const char *symbol_name(uint64_t ip, uint64_t *off)
+{
+    if (!names.buf) {
+        names.buf_cap = 256;
+        if (!(names.buf = meta_alloc(names.buf_cap))) return "";
+    }
+
+    while (true) {
+        size_t len = unwind_symbol(ip, names.buf, names.buf_cap, off);
+        if (len < names.buf_cap) return name_intern(names.buf, len);
+
+        size_t cap = names.buf_cap * 2;
+        while (cap <= len) cap *= 2;
+
+        char *buf = meta_alloc(cap);
+        if (!buf) return name_intern(names.buf, strlen(names.buf));
 
-static struct source *source_get()
+        meta_free(names.buf);
+        names.buf = buf;
+        names.buf_cap = cap;
+    }
+}
+
+const char *prof_symbol_name(uint64_t ip, uint64_t *off)
 {
-    uint64_t hash; size_t len;
-    source_hash(&hash, &len);
+    pmem_lock(&dump_lock);
+    const char *name = symbol_name(ip, off);
+    pmem_unlock(&dump_lock);
+    return name;
+}
 
-    struct htable_ret ret = htable_get(&sources, hash);
+// Must be called while holding dump_lock. Symbols are never freed.
+static struct symbol *symbol_get(uint64_t ip)
+{
+    struct htable_ret ret = htable_get(&symbols, ip);
     if (ret.ok) return pun_itop(ret.value);
 
-    struct source *source = mem_calloc(1, sizeof(*source) + sizeof(source->bt[0]) * len);
-    source->hash = hash;
-    source->len = len;
-    source_bt(source);
-
-    ret = htable_put(&sources, hash, pun_ptoi(source));
-    assert(ret.ok);
+    struct symbol *symbol = meta_calloc(1, sizeof(*symbol));
+    symbol->name = symbol_name(ip, &symbol->off);
+    meta_htable_put(&symbols, ip, pun_ptoi(symbol));
 
-    return source;
+    return symbol;
 }
 
 
 // -----------------------------------------------------------------------------
-// prof
+// sample
 // -----------------------------------------------------------------------------
 
-static void prof_dump(size_t len)
+// xorshift64*: https://en.wikipedia.org/wiki/Xorshift#xorshift*
+static uint64_t sample_rng(void)
 {
-    size_t churn_current = atomic_fetch_add(&churn, len) + len;
-    if (churn_current < churn_thresh) return;
+    uint64_t x = sampler.rng;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    sampler.rng = x;
+    return x * 0x2545f4914f6cdd1dUL;
+}
 
-    if (!pmem_try_lock(&dump_lock)) return;
-    pmem_lock(&prof_lock);
-    profiling = true;
+// Bytes until the next sample are drawn from an exponential distribution which
+// makes the process memoryless: an allocation of len bytes is sampled with a
+// probability of 1 - exp(-len / interval) regardless of what came before.
+static int64_t sample_next(void)
+{
+    double uniform = (sample_rng() >> 11) * 0x1.0p-53;
+    return (int64_t) (-log(1.0 - uniform) * sample_interval) + 1;
+}
 
-    atomic_store(&churn, 0);
+static bool sample(size_t len)
+{
+    if (!sample_interval) return true;
 
-    char file[256] = {0};
-    snprintf(file, sizeof(file), "./pmem.%d.log", getpid());
-    int fd = open(file, O_CREAT | O_APPEND | O_WRONLY, 0600);
-    if (fd == -1) {
-        fprintf(stderr, "unable to open '%s': %s(%d)\n", file, strerror(errno), errno);
-        goto fail_dump;
+    if (unlikely(!sampler.rng)) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        sampler.rng = addr_hash(ts.tv_nsec, (uintptr_t) &sampler) | 1;
+        sampler.countdown = sample_next();
     }
 
-    static size_t snapshot = 0;
-    dprintf(fd,
-            "\n[%3zu]=========================================================\n"
-            "churn=%zu/%zu\n",
-            snapshot++, churn_current, churn_thresh);
+    sampler.countdown -= len;
+    if (likely(sampler.countdown > 0)) return false;
 
+    sampler.countdown = sample_next();
+    return true;
+}
 
-    for (struct htable_bucket *it = htable_next(&sources, NULL); it;
-         it = htable_next(&sources, it))
-    {
-        struct source *source = pun_itop(it->value);
+// Depends only on the length so that the same weight is computed when the
+// allocation is sampled and when it's freed.
+static size_t sample_weight(size_t len)
+{
+    if (!sample_interval) return weight_unit;
+
+    double prob = 1.0 - exp(-(double) len / sample_interval);
+    return (size_t) (weight_unit / prob + 0.5);
+}
 
-        size_t live = source->alloc.total - source->free.total;
-        size_t allocated = source->alloc.total - source->alloc.prev;
-        size_t freed = source->free.total - source->free.prev;
-        if (!live || (!allocated && !freed)) continue;
+static inline size_t weight_count(size_t value)
+{
+    return (value + weight_unit / 2) >> weight_shift;
+}
 
-        dprintf(fd, "\n{%lx} live:%zu, alloc:%zu/%zu, free:%zu/%zu\n",
-                source->hash, live,
-                allocated, source->alloc.total,
-                freed, source->free.total);
-        source->alloc.prev = source->alloc.total;
-        source->free.prev = source->free.total;
 
-        for (size_t i = 0; i < source->len; ++i) {
-            struct frame *frame = &source->bt[i];
-            if (!frame->off)
-                dprintf(fd, "  {%zu} %s\n", i, frame->name);
-            else
-                dprintf(fd, "  {%zu} %s+%lu\n", i, frame->name, frame->off);
-        }
+// -----------------------------------------------------------------------------
+// writer
+// -----------------------------------------------------------------------------
+
+// Dumps are formatted into a buffer that is only written out once full which
+// keeps the number of syscalls independent of the number of sources.
+struct writer
+{
+    int fd;
+    bool error;
+    size_t len;
+    char buf[64 * 1024];
+};
+
+static void writer_flush(struct writer *writer)
+{
+    size_t off = 0;
+    while (!writer->error && off < writer->len) {
+        ssize_t ret = write(writer->fd, writer->buf + off, writer->len - off);
+        if (ret > 0) off += ret;
+        else if (ret == -1 && errno == EINTR) continue;
+        else writer->error = true;
     }
+    writer->len = 0;
+}
 
+static bool writer_open(struct writer *writer, const char *file, int flags)
+{
+    writer->fd = open(file, O_WRONLY | flags, 0600);
+    if (writer->fd == -1) {
+        fprintf(stderr, "unable to open '%s': %s(%d)\n", file, strerror(errno), errno);
+        return false;
+    }
 
-    close(fd);
-  fail_dump:
-    profiling = false;
-    pmem_unlock(&prof_lock);
-    pmem_unlock(&dump_lock);
+    writer->len = 0;
+    writer->error = false;
+    return true;
 }
 
-void prof_alloc(void *ptr, size_t len)
+static void writer_close(struct writer *writer, const char *file)
 {
-    if (profiling) return;
-    pmem_lock(&prof_lock);
-    profiling = true;
+    writer_flush(writer);
+    if (writer->error)
+        fprintf(stderr, "unable to write '%s': %s(%d)\n", file, strerror(errno), errno);
 
-    struct source *source = source_get();
-    source->alloc.total++;
+    close(writer->fd);
+    writer->fd = -1;
+}
 
-    struct htable_ret ret = htable_put(&live, pun_ptoi(ptr), pun_ptoi(source));
-    assert(ret.ok);
+static void writer_put(struct writer *writer, const void *data, size_t len)
+{
+    while (len) {
+        if (writer->len == sizeof(writer->buf)) writer_flush(writer);
 
-    profiling = false;
-    pmem_unlock(&prof_lock);
+        size_t n = sizeof(writer->buf) - writer->len;
+        if (n > len) n = len;
 
-    prof_dump(len);
+        memcpy(writer->buf + writer->len, data, n);
+        writer->len += n;
+        data = (const uint8_t *) data + n;
+        len -= n;
+    }
 }
 
-void prof_free(void *ptr)
+__attribute__((format(printf, 2, 3)))
+static void writer_printf(struct writer *writer, const char *fmt, ...)
 {
-    if (profiling) return;
-    pmem_lock(&prof_lock);
-    profiling = true;
+    for (size_t attempt = 0; attempt < 2; ++attempt) {
+        size_t cap = sizeof(writer->buf) - writer->len;
 
-    struct htable_ret ret = htable_del(&live, pun_ptoi(ptr));
-    assert(ret.ok);
+        va_list args;
+        va_start(args, fmt);
+        int len = vsnprintf(writer->buf + writer->len, cap, fmt, args);
+        va_end(args);
 
-    struct source *source = pun_itop(ret.value);
-    source->free.total++;
+        if (len < 0) return;
+        if ((size_t) len < cap) { writer->len += len; return; }
 
-    profiling = false;
-    pmem_unlock(&prof_lock);
+        // Lines longer than the buffer are truncated.
+        if (attempt) { writer->len = sizeof(writer->buf) - 1; return; }
+        writer_flush(writer);
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// dump
+// -----------------------------------------------------------------------------
+
+static struct snapshot_counter snapshot_counter(struct counter *counter)
+{
+    size_t total = atomic_load_explicit(&counter->total, memory_order_relaxed);
+    struct snapshot_counter ret = { .curr = total - counter->prev, .total = total };
+    counter->prev = total;
+    return ret;
+}
+
+// Threads are merged one after the other while the others keep going so a free
+// can reach its source before the allocation it pairs with. Live counts are
+// clamped at 0 until the allocation catches up.
+static inline size_t snapshot_sub(size_t alloc, size_t freed)
+{
+    return alloc > freed ? alloc - freed : 0;
+}
+
+static inline size_t snapshot_live(const struct snapshot_entry *entry)
+{
+    return snapshot_sub(entry->alloc.count.total, entry->free.count.total);
+}
+
+static inline size_t snapshot_live_bytes(const struct snapshot_entry *entry)
+{
+    return snapshot_sub(entry->alloc.bytes.total, entry->free.bytes.total);
+}
+
+// Without top_n, the text and binary formats only include sources that are
+// live and changed.
+static inline bool snapshot_changed(const struct snapshot_entry *entry)
+{
+    return snapshot_live(entry) && (entry->alloc.count.curr || entry->free.count.curr);
+}
+
+// Resident set size of the process in bytes or 0 if it can't be read.
+static size_t dump_rss(void)
+{
+    int fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+
+    char buf[128];
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0) return 0;
+    buf[len] = 0;
+
+    // Fields are in pages: size resident shared text lib data dt
+    char *it = NULL;
+    strtoull(buf, &it, 10);
+    return strtoull(it, NULL, 10) * sysconf(_SC_PAGESIZE);
+}
+
+// Must be called while holding dump_lock.
+static void dump_copy(void)
+{
+    stats_merge();
+    snapshot.len = 0;
+
+    snapshot.rss = dump_rss();
+    mem_stats(&snapshot.heap);
+
+    struct source_table *table = atomic_load_explicit(&sources, memory_order_acquire);
+    if (!table) return;
+
+    if (snapshot.cap < table->cap) {
+        if (snapshot.entries) meta_free(snapshot.entries);
+        if (snapshot.selected) meta_free(snapshot.selected);
+        snapshot.cap = 0;
+
+        snapshot.entries = meta_alloc(table->cap * sizeof(*snapshot.entries));
+        snapshot.selected = meta_alloc(table->cap * sizeof(*snapshot.selected));
+        if (!snapshot.entries || !snapshot.selected) {
+            if (snapshot.entries) meta_free(snapshot.entries);
+            if (snapshot.selected) meta_free(snapshot.selected);
+            snapshot.entries = NULL;
+            snapshot.selected = NULL;
+            return;
+        }
+        snapshot.cap = table->cap;
+    }
+
+    for (size_t slot = 0; slot < table->cap; ++slot) {
+        struct source *source =
+            atomic_load_explicit(&table->slots[slot], memory_order_acquire);
+        if (!source) continue;
+
+        struct snapshot_entry *entry = &snapshot.entries[snapshot.len];
+        entry->source = source;
+        entry->alloc.count = snapshot_counter(&source->alloc.count);
+        entry->alloc.bytes = snapshot_counter(&source->alloc.bytes);
+        entry->free.count = snapshot_counter(&source->free.count);
+        entry->free.bytes = snapshot_counter(&source->free.bytes);
+
+        // The window is updated for every source such that it never goes stale.
+        size_t live = snapshot_live_bytes(entry);
+        size_t oldest = source->window[(snapshot.index + 1) % (top_window + 1)];
+        source->window[snapshot.index % (top_window + 1)] = live;
+        entry->growth = (int64_t) (live - oldest);
+
+        if (!snapshot_live(entry) && !entry->alloc.count.curr && !entry->free.count.curr)
+            continue;
+
+        for (size_t i = 0; i < hist_len; ++i) {
+            entry->sizes[i] = atomic_load_explicit(&source->sizes[i], memory_order_relaxed);
+            entry->lifetimes[i] = atomic_load_explicit(&source->lifetimes[i], memory_order_relaxed);
+        }
+
+        snapshot.len++;
+    }
+}
+
+static void top_swap(struct top *top, size_t i, size_t j)
+{
+    __typeof__(top->items[0]) tmp = top->items[i];
+    top->items[i] = top->items[j];
+    top->items[j] = tmp;
+}
+
+static void top_sift_down(struct top *top, size_t i)
+{
+    while (true) {
+        size_t min = i, left = i * 2 + 1, right = i * 2 + 2;
+        if (left < top->len && top->items[left].key < top->items[min].key) min = left;
+        if (right < top->len && top->items[right].key < top->items[min].key) min = right;
+        if (min == i) return;
+
+        top_swap(top, i, min);
+        i = min;
+    }
+}
+
+// Keeps the top_n entries with the largest keys.
+static void top_push(struct top *top, int64_t key, struct snapshot_entry *entry)
+{
+    if (top->len < top_n) {
+        size_t i = top->len++;
+        top->items[i].key = key;
+        top->items[i].entry = entry;
+
+        while (i && top->items[(i - 1) / 2].key > top->items[i].key) {
+            top_swap(top, i, (i - 1) / 2);
+            i = (i - 1) / 2;
+        }
+    }
+
+    else if (key > top->items[0].key) {
+        top->items[0].key = key;
+        top->items[0].entry = entry;
+        top_sift_down(top, 0);
+    }
+}
+
+// Empties the heap into selected from the largest to the smallest key while
+// skipping the entries that were already selected.
+static void top_select(struct top *top)
+{
+    size_t start = snapshot.selected_len;
+    snapshot.selected_len += top->len;
+
+    for (size_t i = snapshot.selected_len; top->len; ) {
+        snapshot.selected[--i] = top->items[0].entry;
+        top->items[0] = top->items[--top->len];
+        top_sift_down(top, 0);
+    }
+
+    size_t end = start;
+    for (size_t i = start; i < snapshot.selected_len; ++i) {
+        bool dup = false;
+        for (size_t j = 0; !dup && j < start; ++j)
+            dup = snapshot.selected[j] == snapshot.selected[i];
+        if (!dup) snapshot.selected[end++] = snapshot.selected[i];
+    }
+    snapshot.selected_len = end;
+}
+
+// Selects the entries to write. Without top_n, every entry is selected unless
+// changed is set in which case only the ones that changed are. With top_n,
+// the sources holding the most live bytes are selected followed by the ones
+// that grew the most, regardless of whether they changed.
+static void dump_select(bool changed)
+{
+    snapshot.selected_len = 0;
+
+    if (!top_n) {
+        for (size_t it = 0; it < snapshot.len; ++it) {
+            struct snapshot_entry *entry = &snapshot.entries[it];
+            if (changed && !snapshot_changed(entry)) continue;
+            snapshot.selected[snapshot.selected_len++] = entry;
+        }
+        return;
+    }
+
+    static struct top top = {0};
+    if (!top.items && !(top.items = meta_alloc(top_n * sizeof(*top.items)))) return;
+
+    for (size_t it = 0; it < snapshot.len; ++it) {
+        struct snapshot_entry *entry = &snapshot.entries[it];
+        size_t live = snapshot_live_bytes(entry);
+        if (live) top_push(&top, live, entry);
+    }
+    top_select(&top);
+
+    for (size_t it = 0; it < snapshot.len; ++it) {
+        struct snapshot_entry *entry = &snapshot.entries[it];
+        if (entry->growth > 0) top_push(&top, entry->growth, entry);
+    }
+    top_select(&top);
+}
+
+static void text_hist(struct writer *writer, const size_t *hist)
+{
+    for (size_t i = 0; i < hist_len; ++i) {
+        if (!weight_count(hist[i])) continue;
+        writer_printf(writer, " %zu:%zu", hist_min(i), weight_count(hist[i]));
+    }
+    writer_put(writer, "\n", 1);
+}
+
+static void text_trigger(struct writer *writer, int trigger)
+{
+    const char *names[] = { "churn", "timer", "signal", "hwm" };
+
+    bool first = true;
+    writer_printf(writer, "trigger=");
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (!(trigger & (1 << i))) continue;
+        writer_printf(writer, "%s%s", first ? "" : ",", names[i]);
+        first = false;
+    }
+    writer_put(writer, "\n", 1);
+}
+
+static void text_heap(struct writer *writer)
+{
+    const struct pmem_stats *heap = &snapshot.heap;
+
+    size_t mapped = 0, used = 0, spare = 0;
+    for (size_t i = 0; i < pmem_stats_classes; ++i) {
+        const struct pmem_stats_class *class = &heap->classes[i];
+        mapped += class->spans * heap->span_len;
+        used += class->used * class->len;
+        spare += class->free * class->len;
+    }
+
+    writer_printf(writer, "rss=%zu\n", snapshot.rss);
+    writer_printf(writer, "heap: mapped:%zu, used:%zu, free:%zu\n", mapped, used, spare);
+
+    for (size_t i = 0; i < pmem_stats_classes; ++i) {
+        const struct pmem_stats_class *class = &heap->classes[i];
+        if (!class->spans) continue;
+
+        writer_printf(writer, "  %zu: mapped:%zu, used:%zu, free:%zu\n",
+                class->len, class->spans * heap->span_len,
+                class->used * class->len, class->free * class->len);
+    }
+
+    writer_printf(writer, "vma: mapped:%zu, requested:%zu, cached:%zu\n",
+            heap->vma_bytes, heap->vma_requested, heap->vma_cached);
+}
+
+static void dump_text(struct writer *writer)
+{
+    writer_printf(writer,
+            "\n[%3zu]=========================================================\n"
+            "churn=%zu/%zu\n",
+            snapshot.index, snapshot.churn, churn_thresh);
+    text_trigger(writer, snapshot.trigger);
+    if (sample_interval) writer_printf(writer, "sample=%zu\n", sample_interval);
+    if (top_n) writer_printf(writer, "top=%zu/%zu\n", top_n, top_window);
+    text_heap(writer);
+
+    dump_select(true);
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct snapshot_entry *entry = snapshot.selected[it];
+        struct source *source = entry->source;
+
+        writer_printf(writer, "\n{%lx} live:%zu, alloc:%zu/%zu, free:%zu/%zu\n",
+                source->hash, weight_count(snapshot_live_bytes(entry)),
+                weight_count(entry->alloc.bytes.curr), weight_count(entry->alloc.bytes.total),
+                weight_count(entry->free.bytes.curr), weight_count(entry->free.bytes.total));
+        writer_printf(writer, "  calls: live:%zu, alloc:%zu/%zu, free:%zu/%zu\n",
+                weight_count(snapshot_live(entry)),
+                weight_count(entry->alloc.count.curr), weight_count(entry->alloc.count.total),
+                weight_count(entry->free.count.curr), weight_count(entry->free.count.total));
+
+        if (top_n) {
+            int64_t growth = entry->growth;
+            size_t count = weight_count(growth < 0 ? -growth : growth);
+            writer_printf(writer, "  growth:%c%zu\n", growth < 0 ? '-' : '+', count);
+        }
+
+        writer_printf(writer, "  sizes:");
+        text_hist(writer, entry->sizes);
+
+        if (entry->free.count.total) {
+            size_t lived = 0, short_lived = 0;
+            for (size_t i = 0; i < hist_len; ++i) {
+                lived += weight_count(entry->lifetimes[i]);
+                if (i < lifetime_short) short_lived += weight_count(entry->lifetimes[i]);
+            }
+
+            size_t ratio = lived ? (short_lived * 100 + lived / 2) / lived : 0;
+            writer_printf(writer, "  lifetimes: short:%zu%%, long:%zu%%,", ratio, 100 - ratio);
+            text_hist(writer, entry->lifetimes);
+        }
+
+        for (size_t i = 0; i < source->len; ++i) {
+            struct symbol *symbol = symbol_get(source->ips[i]);
+            if (!symbol->off)
+                writer_printf(writer, "  {%zu} %s\n", i, symbol->name);
+            else
+                writer_printf(writer, "  {%zu} %s+%lu\n", i, symbol->name, symbol->off);
+        }
+    }
+}
+
+// Records are sized by calling their encoder without a writer before writing
+// them out for real which avoids having to buffer them.
+static size_t bin_varint(struct writer *writer, uint64_t value)
+{
+    uint8_t buf[10];
+    size_t len = 0;
+
+    do {
+        buf[len] = value & 0x7F;
+        value >>= 7;
+        if (value) buf[len] |= 0x80;
+        len++;
+    } while (value);
+
+    if (writer) writer_put(writer, buf, len);
+    return len;
+}
+
+static size_t bin_symbol(struct writer *writer, const void *data)
+{
+    const struct symbol *symbol = data;
+    size_t name_len = strlen(symbol->name);
+
+    size_t len = 0;
+    len += bin_varint(writer, symbol->bin.id);
+    len += bin_varint(writer, symbol->off);
+    if (writer) writer_put(writer, symbol->name, name_len);
+    return len + name_len;
+}
+
+static size_t bin_stack(struct writer *writer, const void *data)
+{
+    const struct source *source = data;
+
+    size_t len = 0;
+    len += bin_varint(writer, source->bin.id);
+    len += bin_varint(writer, source->hash);
+    len += bin_varint(writer, source->len);
+    for (size_t i = 0; i < source->len; ++i)
+        len += bin_varint(writer, symbol_get(source->ips[i])->bin.id);
+    return len;
+}
+
+static size_t bin_hist(struct writer *writer, const size_t *hist)
+{
+    size_t buckets = 0;
+    for (size_t i = 0; i < hist_len; ++i)
+        if (weight_count(hist[i])) buckets++;
+
+    size_t len = bin_varint(writer, buckets);
+    for (size_t i = 0; i < hist_len; ++i) {
+        if (!weight_count(hist[i])) continue;
+        len += bin_varint(writer, i);
+        len += bin_varint(writer, weight_count(hist[i]));
+    }
+
+    return len;
+}
+
+static size_t bin_snapshot(struct writer *writer, const void *data)
+{
+    (void) data;
+
+    size_t len = 0;
+    len += bin_varint(writer, snapshot.index);
+    len += bin_varint(writer, snapshot.churn);
+    len += bin_varint(writer, churn_thresh);
+    len += bin_varint(writer, snapshot.trigger);
+    len += bin_varint(writer, sample_interval);
+    len += bin_varint(writer, hist_min(lifetime_short));
+    len += bin_varint(writer, top_n);
+    len += bin_varint(writer, top_window);
+
+    const struct pmem_stats *heap = &snapshot.heap;
+    len += bin_varint(writer, snapshot.rss);
+    len += bin_varint(writer, heap->span_len);
+    len += bin_varint(writer, heap->vma_bytes);
+    len += bin_varint(writer, heap->vma_requested);
+    len += bin_varint(writer, heap->vma_cached);
+
+    size_t classes = 0;
+    for (size_t i = 0; i < pmem_stats_classes; ++i)
+        if (heap->classes[i].spans) classes++;
+
+    len += bin_varint(writer, classes);
+    for (size_t i = 0; i < pmem_stats_classes; ++i) {
+        const struct pmem_stats_class *class = &heap->classes[i];
+        if (!class->spans) continue;
+        len += bin_varint(writer, class->len);
+        len += bin_varint(writer, class->spans);
+        len += bin_varint(writer, class->used);
+        len += bin_varint(writer, class->free);
+    }
+
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct snapshot_entry *entry = snapshot.selected[it];
+        len += bin_varint(writer, entry->source->bin.id);
+        len += bin_varint(writer, weight_count(entry->alloc.count.curr));
+        len += bin_varint(writer, weight_count(entry->alloc.count.total));
+        len += bin_varint(writer, weight_count(entry->free.count.curr));
+        len += bin_varint(writer, weight_count(entry->free.count.total));
+        len += bin_varint(writer, weight_count(entry->alloc.bytes.curr));
+        len += bin_varint(writer, weight_count(entry->alloc.bytes.total));
+        len += bin_varint(writer, weight_count(entry->free.bytes.curr));
+        len += bin_varint(writer, weight_count(entry->free.bytes.total));
+
+        len += bin_hist(writer, entry->sizes);
+        len += bin_hist(writer, entry->lifetimes);
+
+        // Zigzag encoded such that shrinks stay small.
+        int64_t growth = entry->growth;
+        size_t count = weight_count(growth < 0 ? -growth : growth);
+        len += bin_varint(writer, growth < 0 && count ? count * 2 - 1 : count * 2);
+    }
+
+    return len;
+}
+
+static void bin_record(
+        struct writer *writer,
+        enum pmem_bin_type type,
+        size_t (*encode) (struct writer *, const void *),
+        const void *data)
+{
+    uint8_t header = type;
+    uint32_t len = encode(NULL, data);
+
+    writer_put(writer, &header, sizeof(header));
+    writer_put(writer, &len, sizeof(len));
+    encode(writer, data);
+}
+
+// Writes the symbols and stack of every source in the snapshot that weren't
+// already written to the current file.
+static void bin_dict(struct writer *writer)
+{
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct source *source = snapshot.selected[it]->source;
+        if (source->bin.gen == bin.gen) continue;
+
+        for (size_t i = 0; i < source->len; ++i) {
+            struct symbol *symbol = symbol_get(source->ips[i]);
+            if (symbol->bin.gen == bin.gen) continue;
+
+            symbol->bin = (struct bin_id) { .gen = bin.gen, .id = bin.symbols++ };
+            bin_record(writer, pmem_bin_symbol, bin_symbol, symbol);
+        }
+
+        source->bin = (struct bin_id) { .gen = bin.gen, .id = bin.stacks++ };
+        bin_record(writer, pmem_bin_stack, bin_stack, source);
+    }
+}
+
+// The file is truncated and a new generation of ids is started the first time
+// this process writes to it.
+static void dump_bin(void)
+{
+    static struct writer writer = {0};
+
+    char file[512] = {0};
+    snprintf(file, sizeof(file), "%s.%d.bin", dump_path, getpid());
+
+    pid_t pid = getpid();
+    bool fresh = bin.pid != pid;
+    if (!writer_open(&writer, file, fresh ? O_CREAT | O_TRUNC : O_APPEND)) return;
+
+    if (fresh) {
+        uint32_t version = pmem_bin_version;
+        writer_put(&writer, PMEM_BIN_MAGIC, 4);
+        writer_put(&writer, &version, sizeof(version));
+
+        bin.pid = pid;
+        bin.gen++;
+        bin.symbols = bin.stacks = 0;
+    }
+
+    dump_select(true);
+    bin_dict(&writer);
+    bin_record(&writer, pmem_bin_snapshot, bin_snapshot, NULL);
+    writer_close(&writer, file);
+}
+
+// Legacy gperftools heap profile which pprof reads along with the mappings to
+// symbolize the addresses. The in-use view counts what is live while the
+// allocated view counts what was allocated since the previous snapshot.
+static void dump_pprof(void)
+{
+    static struct writer writer = {0};
+
+    char file[512] = {0};
+    snprintf(file, sizeof(file), "%s.%d.%zu.heap", dump_path, getpid(), snapshot.index);
+    if (!writer_open(&writer, file, O_CREAT | O_TRUNC)) return;
+
+    dump_select(false);
+
+    size_t live = 0, live_bytes = 0, allocated = 0, allocated_bytes = 0;
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct snapshot_entry *entry = snapshot.selected[it];
+        live += weight_count(snapshot_live(entry));
+        live_bytes += weight_count(snapshot_live_bytes(entry));
+        allocated += weight_count(entry->alloc.count.curr);
+        allocated_bytes += weight_count(entry->alloc.bytes.curr);
+    }
+
+    writer_printf(&writer, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n",
+            live, live_bytes, allocated, allocated_bytes);
+
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct snapshot_entry *entry = snapshot.selected[it];
+        if (!snapshot_live(entry) && !entry->alloc.count.curr) continue;
+
+        writer_printf(&writer, "%zu: %zu [%zu: %zu] @",
+                weight_count(snapshot_live(entry)),
+                weight_count(snapshot_live_bytes(entry)),
+                weight_count(entry->alloc.count.curr),
+                weight_count(entry->alloc.bytes.curr));
+        for (size_t i = 0; i < entry->source->len; ++i)
+            writer_printf(&writer, " 0x%lx", entry->source->ips[i]);
+        writer_put(&writer, "\n", 1);
+    }
+
+    writer_printf(&writer, "\nMAPPED_LIBRARIES:\n");
+
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd != -1) {
+        char buf[4096];
+        ssize_t len = 0;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) writer_put(&writer, buf, len);
+        close(fd);
+    }
+
+    writer_close(&writer, file);
+}
+
+// Frames are written from the root to the leaf and separated by ';' which
+// therefore can't appear in the symbol names.
+static void collapsed_stack(struct writer *writer, struct source *source, size_t bytes)
+{
+    if (!source->len) writer_put(writer, "[overflow] ", 11);
+
+    for (size_t i = source->len; i > 0; --i) {
+        struct symbol *symbol = symbol_get(source->ips[i - 1]);
+
+        const char *name = symbol->name;
+        while (*name) {
+            size_t len = strcspn(name, ";");
+            writer_put(writer, name, len);
+
+            name += len;
+            if (*name) { writer_put(writer, ":", 1); name++; }
+        }
+
+        writer_put(writer, i > 1 ? ";" : " ", 1);
+    }
+
+    writer_printf(writer, "%zu\n", bytes);
+}
+
+static void dump_collapsed_view(const char *view, bool inuse)
+{
+    static struct writer writer = {0};
+
+    char file[512] = {0};
+    snprintf(file, sizeof(file), "%s.%d.%zu.%s.folded", dump_path, getpid(), snapshot.index, view);
+    if (!writer_open(&writer, file, O_CREAT | O_TRUNC)) return;
+
+    for (size_t it = 0; it < snapshot.selected_len; ++it) {
+        struct snapshot_entry *entry = snapshot.selected[it];
+
+        size_t bytes = weight_count(inuse ? snapshot_live_bytes(entry) : entry->alloc.bytes.curr);
+        if (bytes) collapsed_stack(&writer, entry->source, bytes);
+    }
+
+    writer_close(&writer, file);
+}
+
+// Collapsed stacks as consumed by Brendan Gregg's flamegraph.pl with one file
+// for each view.
+static void dump_collapsed(void)
+{
+    dump_select(false);
+    dump_collapsed_view("inuse", true);
+    dump_collapsed_view("alloc", false);
+}
+
+static void dump_text_file(void)
+{
+    static struct writer writer = {0};
+
+    char file[512] = {0};
+    snprintf(file, sizeof(file), "%s.%d.log", dump_path, getpid());
+    if (!writer_open(&writer, file, O_CREAT | O_APPEND)) return;
+
+    dump_text(&writer);
+    writer_close(&writer, file);
+}
+
+static enum format format_parse(const char *str)
+{
+    if (!strcmp(str, "text")) return format_text;
+    if (!strcmp(str, "bin")) return format_bin;
+    if (!strcmp(str, "pprof")) return format_pprof;
+    if (!strcmp(str, "collapsed")) return format_collapsed;
+
+    fprintf(stderr, "unknown format '%s': falling back to text\n", str);
+    return format_text;
+}
+
+// Must be called while holding dump_lock.
+static void dump_write(void)
+{
+    switch (dump_format) {
+    case format_text: { dump_text_file(); break; }
+    case format_bin: { dump_bin(); break; }
+    case format_pprof: { dump_pprof(); break; }
+    case format_collapsed: { dump_collapsed(); break; }
+    case format_unknown:
+    default: { assert(false); }
+    }
+}
+
+// Must be called with profiling set.
+static void dump(int trigger)
+{
+    if (!pmem_try_lock(&dump_lock)) return;
+
+    if (unlikely(dump_format == format_unknown)) dump_format = format_parse(PMEM_FORMAT);
+
+    snapshot.trigger = trigger;
+    snapshot.churn = atomic_exchange(&churn, 0);
+    dump_copy();
+    dump_write();
+    snapshot.index++;
+
+    pmem_unlock(&dump_lock);
+}
+
+// The dumper never profiles its own allocations. The timer fires when no dumps
+// were made for dump_period milliseconds. The dumper also wakes up every
+// dumper_tick to let the allocator release the memory that decayed.
+static void *dumper_run(void *data)
+{
+    (void) data;
+    profiling = true;
+
+    uint32_t last = clock_ms();
+    while (true) {
+        int trigger = atomic_exchange(&dump_pending, 0);
+        mem_decay();
+
+        uint32_t elapsed = clock_ms() - last;
+        if (dump_period && elapsed >= dump_period) trigger |= trigger_timer;
+
+        if (!trigger) {
+            uint64_t timeout = dumper_tick;
+            if (dump_period && dump_period - elapsed < timeout) timeout = dump_period - elapsed;
+            pmem_wait(&dump_pending, 0, timeout);
+            continue;
+        }
+
+        dump(trigger);
+        last = clock_ms();
+    }
+
+    return NULL;
+}
+
+static void dumper_signal(int sig)
+{
+    (void) sig;
+    int err = errno;
+
+    if (!(atomic_fetch_or(&dump_pending, trigger_signal) & trigger_signal))
+        pmem_wake(&dump_pending);
+
+    errno = err;
+}
+
+// Returns false if the dumper couldn't be started in which case the caller is
+// expected to dump by itself. Must be called with profiling set.
+static bool dumper_start(void)
+{
+    int state = atomic_load_explicit(&dumper_state, memory_order_acquire);
+    if (likely(state != dumper_idle)) return state == dumper_running;
+
+    pmem_lock(&dumper_lock);
+
+    if (dumper_state == dumper_idle) {
+        // Signals are blocked so that none of the program's handlers ever run on
+        // the dumper.
+        sigset_t all = {0}, old = {0};
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &old);
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, dumper_run, NULL);
+        pthread_attr_destroy(&attr);
+
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        if (err) fprintf(stderr, "unable to start dumper: %s(%d)\n", strerror(err), err);
+        atomic_store_explicit(&dumper_state,
+                err ? dumper_failed : dumper_running, memory_order_release);
+    }
+
+    pmem_unlock(&dumper_lock);
+    return dumper_state == dumper_running;
+}
+
+
+// -----------------------------------------------------------------------------
+// fork
+// -----------------------------------------------------------------------------
+
+// Every lock is held across a fork such that the child doesn't inherit one that
+// was held by a thread which doesn't exist in its address space. They're taken
+// in the order they nest in: dump_lock is held while merging the stats and
+// sources_lock while allocating from mem whose locks are taken after ours.
+
+void prof_fork_prepare(void)
+{
+    pmem_lock(&dumper_lock);
+    pmem_lock(&dump_lock);
+    pmem_lock(&sources_lock);
+    pmem_lock(&stats_lock);
+
+    for (struct stats *stats = stats_list; stats; stats = stats->next)
+        pmem_lock(&stats->lock);
+}
+
+void prof_fork_parent(void)
+{
+    for (struct stats *stats = stats_list; stats; stats = stats->next)
+        pmem_unlock(&stats->lock);
+
+    pmem_unlock(&stats_lock);
+    pmem_unlock(&sources_lock);
+    pmem_unlock(&dump_lock);
+    pmem_unlock(&dumper_lock);
+}
+
+// The dumper doesn't survive the fork so the child starts its own on its first
+// trigger. The stats of the threads that didn't survive stay on the list and
+// are still merged.
+void prof_fork_child(void)
+{
+    for (struct stats *stats = stats_list; stats; stats = stats->next)
+        stats->lock = 0;
+
+    stats_lock = 0;
+    sources_lock = 0;
+    dump_lock = 0;
+    dumper_lock = 0;
+
+    dump_pending = 0;
+    dumper_state = dumper_idle;
+}
+
+
+// -----------------------------------------------------------------------------
+// config
+// -----------------------------------------------------------------------------
+
+static bool config_invalid(const char *name, const char *str)
+{
+    fprintf(stderr, "invalid value for %s: '%s'\n", name, str);
+    return false;
+}
+
+// Values are always in base 10. strtoull also skips whitespace and accepts a
+// sign which would wrap negative values so they're rejected upfront.
+static bool config_number(const char *str, size_t *value, char **end)
+{
+    if (*str < '0' || *str > '9') return false;
+
+    errno = 0;
+    *value = strtoull(str, end, 10);
+    return !errno;
+}
+
+// Counts and durations in milliseconds.
+static bool config_count(const char *name, size_t *value)
+{
+    const char *str = getenv(name);
+    if (!str || !*str) return false;
+
+    char *end = NULL;
+    size_t parsed = 0;
+    if (!config_number(str, &parsed, &end) || *end) return config_invalid(name, str);
+
+    *value = parsed;
+    return true;
+}
+
+// Sizes in bytes which accept a k, m or g suffix.
+static bool config_size(const char *name, size_t *value)
+{
+    const char *str = getenv(name);
+    if (!str || !*str) return false;
+
+    char *end = NULL;
+    size_t parsed = 0;
+    if (!config_number(str, &parsed, &end)) return config_invalid(name, str);
+
+    size_t shift = 0;
+    switch (*end) {
+    case 'k': case 'K': { shift = 10; end++; break; }
+    case 'm': case 'M': { shift = 20; end++; break; }
+    case 'g': case 'G': { shift = 30; end++; break; }
+    default: { break; }
+    }
+
+    if (*end || parsed > SIZE_MAX >> shift) return config_invalid(name, str);
+
+    *value = parsed << shift;
+    return true;
+}
+
+static int config_signal(const char *str)
+{
+    const char *name = str;
+    if (!strncmp(name, "SIG", 3)) name += 3;
+    if (!strcmp(name, "USR1")) return SIGUSR1;
+    if (!strcmp(name, "USR2")) return SIGUSR2;
+
+    char *end = NULL;
+    long sig = strtol(str, &end, 10);
+    if (*str && !*end && sig > 0 && sig < NSIG) return sig;
+
+    fprintf(stderr, "invalid value for PMEM_SIGNAL: '%s'\n", str);
+    return 0;
+}
+
+// Read once when the library is loaded. Allocations made before then, by the
+// loader or by other constructors, use the defaults from config.h.
+__attribute__((constructor))
+static void prof_config(void)
+{
+    size_t value = 0;
+    if (config_count("PMEM_PROFILE", &value)) prof_enabled = value;
+    if (!prof_enabled) return;
+
+    if (config_size("PMEM_CHURN_THRESH", &value)) {
+        churn_thresh = value;
+        churn_local_thresh = value / 64;
+    }
+    if (config_count("PMEM_PERIOD", &value)) dump_period = value;
+    config_size("PMEM_HWM_STEP", &hwm_step);
+    config_size("PMEM_SAMPLE_INTERVAL", &sample_interval);
+    config_count("PMEM_TOP_N", &top_n);
+
+    const char *str = getenv("PMEM_FORMAT");
+    dump_format = format_parse(str && *str ? str : PMEM_FORMAT);
+
+    if ((str = getenv("PMEM_PATH")) && *str)
+        snprintf(dump_path, sizeof(dump_path), "%s", str);
+
+    if ((str = getenv("PMEM_SIGNAL")) && *str)
+        dump_signal = config_signal(str);
+
+    if (dump_signal) {
+        struct sigaction action = { .sa_handler = dumper_signal, .sa_flags = SA_RESTART };
+        sigemptyset(&action.sa_mask);
+        if (sigaction(dump_signal, &action, NULL) == -1) {
+            fprintf(stderr, "unable to install handler for signal %d: %s(%d)\n",
+                    dump_signal, strerror(errno), errno);
+            dump_signal = 0;
+        }
+    }
+
+    dumper_eager = dump_period || dump_signal;
+}
+
+
+// -----------------------------------------------------------------------------
+// prof
+// -----------------------------------------------------------------------------
+
+// Wakes up the dumper which keeps the cost of dumps off of the allocating
+// threads. Only starts the dumper if trigger is 0.
+static void prof_trigger(int trigger)
+{
+    profiling = true;
+
+    if (likely(dumper_start())) {
+        int pending = atomic_load_explicit(&dump_pending, memory_order_relaxed);
+        if (trigger && (pending & trigger) != trigger &&
+                !atomic_fetch_or(&dump_pending, trigger))
+            pmem_wake(&dump_pending);
+    }
+    else if (trigger) dump(trigger);
+
+    profiling = false;
+}
+
+// Accounts for the churn and the change in live bytes and checks the triggers.
+static void prof_account(size_t len, int64_t delta)
+{
+    int trigger = 0;
+
+    if (churn_thresh && (len = stats_churn(len))) {
+        size_t current = atomic_fetch_add(&churn, len) + len;
+        if (current >= churn_thresh) trigger |= trigger_churn;
+    }
+
+    if (hwm_step && (delta = stats_live(delta))) {
+        int64_t current = atomic_fetch_add(&live, delta) + delta;
+        int64_t mark = atomic_load_explicit(&live_hwm, memory_order_relaxed);
+        if (current >= mark + (int64_t) hwm_step &&
+                atomic_compare_exchange_strong(&live_hwm, &mark, current))
+            trigger |= trigger_hwm;
+    }
+
+    if (likely(!trigger)) {
+        if (likely(!dumper_eager)) return;
+        if (likely(atomic_load_explicit(&dumper_state, memory_order_relaxed) != dumper_idle))
+            return;
+    }
+
+    prof_trigger(trigger);
+}
+
+void prof_stats(struct pmem_stats *stats)
+{
+    pmem_lock(&sources_lock);
+    struct source_table *table = atomic_load_explicit(&sources, memory_order_relaxed);
+    stats->sources = table ? table->len : 0;
+    pmem_unlock(&sources_lock);
+
+    stats->prof_bytes = atomic_load_explicit(&meta_bytes, memory_order_relaxed);
+}
+
+// Sampling is done on the usable size as it's the only length that can be
+// recovered when the allocation is freed.
+void prof_alloc(void *ptr, size_t len)
+{
+    if (unlikely(!prof_enabled) || profiling) return;
+
+    size_t usable = mem_usable_size(ptr);
+    if (sample(usable)) {
+        profiling = true;
+
+        // The backtrace is captured and hashed once, before taking the lock.
+        uint64_t ips[bt_cap];
+        size_t bt_len = unwind(ips, bt_cap);
+
+        uint64_t hash = 0;
+        for (size_t i = 0; i < bt_len; ++i) hash = addr_hash(hash, ips[i]);
+
+        struct source *source = source_get(ips, bt_len, hash);
+        stats_record_alloc(source, sample_weight(usable), usable, len);
+        mem_tag_set(ptr, tag_pack(source->id, clock_ms()));
+
+        profiling = false;
+    }
+
+    prof_account(len, usable);
+}
+
+// The allocation's source is recovered from the allocator's tag which doesn't
+// allocate so there are no re-entrency issues to worry about. Blocks that
+// weren't sampled, or that were allocated by the profiler itself, have no tag.
+// Tags left on blocks allocated before profiling was disabled are never read.
+void prof_free(void *ptr)
+{
+    if (unlikely(!prof_enabled)) return;
+
+    size_t usable = mem_usable_size(ptr);
+
+    uint64_t tag = mem_tag_take(ptr);
+    if (tag) {
+        uint32_t lifetime = clock_ms() - (uint32_t) (tag >> 32);
+        stats_record_free(source_by_id((uint32_t) tag), sample_weight(usable), usable, lifetime);
+    }
 
-    prof_dump(mem_usable_size(ptr));
+    if (!profiling) prof_account(usable, -(int64_t) usable);
 }
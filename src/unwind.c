@@ -0,0 +1,197 @@
+#include "common.h"
+
+#include <pthread.h>
+#include <execinfo.h>
+
+// -----------------------------------------------------------------------------
+// glibc
+// -----------------------------------------------------------------------------
+
+static_assert(sizeof(void *) == sizeof(uint64_t), "incompatible ip type");
+
+size_t unwind_glibc(uint64_t *ips, size_t cap)
+{
+    return backtrace((void **) ips, cap);
+}
+
+// backtrace_symbols formats symbols as "module(func+0xoff) [0xaddr]". Only the
+// function's name is kept such that every ip within it shares the same interned
+// name. func is left empty if the symbol isn't exported in which case the
+// offset relative to the module is the only thing that tells frames apart so
+// it's kept in the name. Anything we can't parse is passed through as-is.
+static size_t symbol_glibc(uint64_t ip, char *name, size_t len, uint64_t *off)
+{
+    *off = 0;
+    name[0] = '\0';
+
+    void *bt[1] = { (void *) ip };
+    char **names = backtrace_symbols(bt, 1);
+    if (!names) return 0;
+
+    const char *str = names[0];
+    const char *open = strchr(str, '(');
+    const char *close = open ? strchr(open, ')') : NULL;
+    const char *plus = close ? memrchr(open, '+', close - open) : NULL;
+
+    int n = 0;
+    if (!plus) n = snprintf(name, len, "%s", str);
+    else if (plus > open + 1) {
+        *off = strtoull(plus + 1, NULL, 16);
+        n = snprintf(name, len, "%.*s", (int) (plus - open - 1), open + 1);
+    }
+    else {
+        unsigned long long module_off = strtoull(plus + 1, NULL, 16);
+        n = snprintf(name, len, "%.*s+0x%llx", (int) (open - str), str, module_off);
+    }
+
+    free(names);
+    return n > 0 ? (size_t) n : 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// libunwind
+// -----------------------------------------------------------------------------
+
+#ifdef PMEM_LIBUNWIND
+
+#define UNW_LOCAL_ONLY
+#include <libunwind.h>
+
+size_t unwind_libunwind(uint64_t *ips, size_t cap)
+{
+    unw_context_t ctx;
+    unw_getcontext(&ctx);
+
+    unw_cursor_t cursor;
+    unw_init_local(&cursor, &ctx);
+
+    size_t len = 0;
+    while (len < cap && unw_step(&cursor) > 0) {
+        unw_word_t ip;
+        unw_get_reg(&cursor, UNW_REG_IP, &ip);
+        ips[len++] = ip;
+    }
+
+    return len;
+}
+
+static const char symbol_unknown[] = "unknown";
+
+// libunwind doesn't tell us how long the name is when it doesn't fit so we
+// return len which makes the caller retry with a larger buffer.
+static size_t symbol_libunwind(uint64_t ip, char *name, size_t len, uint64_t *off)
+{
+    assert(len > sizeof(symbol_unknown));
+
+    int ret = unw_get_proc_name_by_ip(unw_local_addr_space, ip, name, len, off, NULL);
+    if (ret == -UNW_ENOMEM) return len;
+    if (ret == -UNW_ENOINFO) memcpy(name, symbol_unknown, sizeof(symbol_unknown));
+    else assert(!ret);
+
+    return strlen(name);
+}
+
+#endif
+
+
+// -----------------------------------------------------------------------------
+// frame pointer
+// -----------------------------------------------------------------------------
+
+// Walking the frame pointer chain only requires that every frame saves the
+// caller's frame pointer right below the return address which is the case on
+// x86_64 and aarch64 when compiled with -fno-omit-frame-pointer. Every frame is
+// checked against the thread's stack bounds so that a broken chain can't send
+// us reading random memory.
+
+struct frame
+{
+    struct frame *next;
+    uint64_t ip;
+};
+
+static __thread struct { uintptr_t lo, hi; bool init; } stack = {0};
+
+static void stack_init(void)
+{
+    stack.init = true;
+
+    pthread_attr_t attr;
+    if (pthread_getattr_np(pthread_self(), &attr)) return;
+
+    void *addr = NULL; size_t len = 0;
+    if (!pthread_attr_getstack(&attr, &addr, &len)) {
+        stack.lo = (uintptr_t) addr;
+        stack.hi = (uintptr_t) addr + len;
+    }
+
+    pthread_attr_destroy(&attr);
+}
+
+// A chain that ends on a null frame pointer is complete as that's how the
+// outermost frame is marked. Anything else that stops the walk before we
+// collected a few frames most likely means that a frame in between omitted its
+// frame pointer.
+enum { unwind_fp_min = 4 };
+
+__attribute__((noinline))
+static bool unwind_fp_walk(uint64_t *ips, size_t cap, size_t *len)
+{
+    if (unlikely(!stack.init)) stack_init();
+
+    *len = 0;
+    struct frame *frame = __builtin_frame_address(0);
+
+    while (*len < cap) {
+        uintptr_t addr = (uintptr_t) frame;
+        if (!addr) return true;
+
+        if (addr < stack.lo || addr + sizeof(*frame) > stack.hi) break;
+        if (addr % sizeof(void *)) break;
+
+        if (!frame->ip) return true;
+        ips[(*len)++] = frame->ip;
+
+        // Stacks grow down so callers must be at higher addresses.
+        if ((uintptr_t) frame->next <= addr && frame->next) break;
+        frame = frame->next;
+    }
+
+    return *len == cap || *len >= unwind_fp_min;
+}
+
+size_t unwind_fp(uint64_t *ips, size_t cap)
+{
+    size_t len = 0;
+    unwind_fp_walk(ips, cap, &len);
+    return len;
+}
+
+
+// -----------------------------------------------------------------------------
+// unwind
+// -----------------------------------------------------------------------------
+
+size_t unwind(uint64_t *ips, size_t cap)
+{
+#ifdef PMEM_FRAME_POINTER
+    size_t len = 0;
+    if (likely(unwind_fp_walk(ips, cap, &len))) return len;
+#endif
+
+#ifdef PMEM_LIBUNWIND
+    return unwind_libunwind(ips, cap);
+#else
+    return unwind_glibc(ips, cap);
+#endif
+}
+
+size_t unwind_symbol(uint64_t ip, char *name, size_t len, uint64_t *off)
+{
+#ifdef PMEM_LIBUNWIND
+    return symbol_libunwind(ip, name, len, off);
+#else
+    return symbol_glibc(ip, name, len, off);
+#endif
+}
@@ -0,0 +1,62 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+static void check(void *ptr, size_t align, size_t len)
+{
+    assert(ptr);
+    assert(!((uintptr_t) ptr % align));
+    assert(malloc_usable_size(ptr) >= len);
+    memset(ptr, 0xFF, len);
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    enum { allocations = 100 };
+    size_t aligns[] = { 8, 16, 32, 64, 128, 512, 4096, 8192, 1UL << 16, 1UL << 21 };
+    size_t sizes[] = { 0, 1, 24, 100, 1000, 4096, 5000, 40000, 1UL << 20 };
+
+    static void *data[allocations] = {0};
+
+    for (size_t i = 0; i < sizeof_arr(aligns); ++i) {
+        for (size_t j = 0; j < sizeof_arr(sizes); ++j) {
+            size_t align = aligns[i], len = sizes[j];
+
+            for (size_t k = 0; k < allocations; ++k) {
+                switch (k % 3) {
+                case 0: assert(!posix_memalign(&data[k], align, len)); break;
+                case 1: data[k] = aligned_alloc(align, len); break;
+                case 2: data[k] = memalign(align, len); break;
+                default: assert(false);
+                }
+                check(data[k], align, len);
+            }
+
+            for (size_t k = 0; k < allocations; ++k) free(data[k]);
+        }
+    }
+
+    size_t page = sysconf(_SC_PAGE_SIZE);
+
+    void *ptr = valloc(100);
+    check(ptr, page, 100);
+    free(ptr);
+
+    ptr = pvalloc(100);
+    check(ptr, page, page);
+    free(ptr);
+
+    assert(posix_memalign(&ptr, 3, 10) == EINVAL);
+    assert(posix_memalign(&ptr, 4, 10) == EINVAL);
+    assert(!aligned_alloc(24, 10) && errno == EINVAL);
+}
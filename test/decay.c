@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../config.h"
+
+// The burst fills about 40 spans of 1Mb. Light traffic is done in a different
+// class such that it only goes through the slow paths which drive the decay.
+enum { burst = 200 * 1000, burst_len = 200, light = 1000, light_len = 64 };
+
+// Waits for two decay intervals which also covers the purge rate limit.
+static const unsigned wait_us = 2 * PMEM_SPAN_DECAY * 1000;
+
+static size_t rss(void)
+{
+    FILE *file = fopen("/proc/self/statm", "r");
+    assert(file);
+
+    size_t pages = 0, resident = 0;
+    int ret = fscanf(file, "%zu %zu", &pages, &resident);
+    assert(ret == 2); (void) ret;
+
+    fclose(file);
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void traffic(void)
+{
+    static void *data[light] = {0};
+    for (size_t i = 0; i < light; ++i) data[i] = malloc(light_len);
+    for (size_t i = 0; i < light; ++i) free(data[i]);
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    static void *data[burst] = {0};
+    size_t base = rss();
+
+    for (size_t i = 0; i < burst; ++i) {
+        data[i] = malloc(burst_len);
+        memset(data[i], 0xFF, burst_len);
+    }
+    for (size_t i = 0; i < burst; ++i) free(data[i]);
+
+    size_t peak = rss();
+    assert(peak >= base + 32 * PMEM_SPAN_LEN);
+
+    usleep(wait_us);
+    traffic();
+
+    // The RSS also accounts for the profiler's tables which don't shrink so
+    // only the drop is checked. The thread cache can still hold blocks that
+    // keep a span or two mapped.
+    assert(rss() + 32 * PMEM_SPAN_LEN <= peak);
+}
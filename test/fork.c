@@ -0,0 +1,74 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+enum { threads = 8, forks = 200, allocations = 100 };
+
+static const size_t sizes[] = { 8, 100, 1024, 32768, 1 << 20 };
+
+static atomic_bool done = false;
+
+// Keeps every lock of the allocator and the profiler busy while forking.
+static void *run_churn(void *arg)
+{
+    size_t id = (uintptr_t) arg;
+    void *data[allocations];
+
+    for (size_t it = 0; !atomic_load(&done); ++it) {
+        size_t len = sizes[(id + it) % sizeof_arr(sizes)];
+        for (size_t i = 0; i < allocations; ++i) data[i] = malloc(len);
+        for (size_t i = 0; i < allocations; ++i) free(data[i]);
+    }
+
+    return NULL;
+}
+
+// A child that inherited a held lock hangs on its first allocation which the
+// alarm turns into a failure.
+static void run_child(void)
+{
+    alarm(10);
+
+    for (size_t i = 0; i < sizeof_arr(sizes); ++i) {
+        void *ptr = malloc(sizes[i]);
+        assert(ptr);
+        memset(ptr, 0, sizes[i]);
+        free(ptr);
+    }
+
+    _exit(0);
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    pthread_t churn[threads];
+    for (size_t i = 0; i < threads; ++i)
+        pthread_create(&churn[i], NULL, run_churn, (void *) (uintptr_t) i);
+
+    for (size_t i = 0; i < forks; ++i) {
+        pid_t pid = fork();
+        assert(pid >= 0);
+        if (!pid) run_child();
+
+        int status = 0;
+        assert(waitpid(pid, &status, 0) == pid);
+        assert(WIFEXITED(status) && !WEXITSTATUS(status));
+    }
+
+    atomic_store(&done, true);
+    for (size_t i = 0; i < threads; ++i) pthread_join(churn[i], NULL);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+
+static void fill(uint8_t *ptr, size_t len, uint8_t seed)
+{
+    for (size_t i = 0; i < len; ++i) ptr[i] = (uint8_t) (seed + i * 31);
+}
+
+static void check(const uint8_t *ptr, size_t len, uint8_t seed)
+{
+    for (size_t i = 0; i < len; ++i) assert(ptr[i] == (uint8_t) (seed + i * 31));
+}
+
+
+// -----------------------------------------------------------------------------
+// tests
+// -----------------------------------------------------------------------------
+
+// Growing or shrinking within the usable size must not move the block.
+static void test_in_place(void)
+{
+    uint8_t *ptr = malloc(100);
+    fill(ptr, 100, 1);
+
+    size_t usable = malloc_usable_size(ptr);
+    assert(usable >= 100);
+
+    uint8_t *grown = realloc(ptr, usable);
+    assert(grown == ptr);
+    check(grown, 100, 1);
+
+    uint8_t *shrunk = realloc(grown, usable - 1);
+    assert(shrunk == ptr);
+    check(shrunk, 100, 1);
+
+    free(shrunk);
+}
+
+// Moving across size classes must preserve the smallest of both lengths.
+static void test_move(void)
+{
+    uint8_t *ptr = malloc(16);
+    fill(ptr, 16, 2);
+
+    size_t len = 16;
+    for (; len <= 1UL << 20; len *= 2) {
+        ptr = realloc(ptr, len);
+        check(ptr, len / 2, 2);
+        fill(ptr, len, 2);
+    }
+
+    for (len /= 2; len >= 16; len /= 2) {
+        ptr = realloc(ptr, len);
+        check(ptr, len, 2);
+        assert(malloc_usable_size(ptr) >= len);
+    }
+
+    free(ptr);
+}
+
+// Large blocks are remapped and must keep their content page after page.
+static void test_large(void)
+{
+    size_t len = 64 * 1024;
+    uint8_t *ptr = malloc(len);
+    fill(ptr, len, 3);
+
+    uint8_t *same = realloc(ptr, len - 1);
+    assert(same == ptr);
+
+    for (size_t i = 0; i < 8; ++i) {
+        ptr = realloc(ptr, len * 2);
+        check(ptr, len, 3);
+        fill(ptr, len * 2, 3);
+        len *= 2;
+    }
+
+    ptr = realloc(ptr, 64 * 1024);
+    check(ptr, 64 * 1024, 3);
+
+    ptr = realloc(ptr, 10);
+    check(ptr, 10, 3);
+    assert(malloc_usable_size(ptr) < 4096);
+
+    free(ptr);
+}
+
+// Large blocks are rounded up so they have room to grow without moving.
+static void test_headroom(void)
+{
+    size_t len = 40 * 1024;
+    uint8_t *ptr = malloc(len);
+    fill(ptr, len, 5);
+
+    size_t usable = malloc_usable_size(ptr);
+    assert(usable > len);
+
+    uint8_t *grown = realloc(ptr, usable);
+    assert(grown == ptr);
+    check(grown, len, 5);
+
+    free(grown);
+}
+
+static void test_edges(void)
+{
+    uint8_t *ptr = realloc(NULL, 32);
+    assert(ptr);
+    fill(ptr, 32, 4);
+    assert(!realloc(ptr, 0));
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    for (size_t it = 0; it < 10; ++it) {
+        test_in_place();
+        test_move();
+        test_large();
+        test_headroom();
+        test_edges();
+    }
+}
@@ -0,0 +1,66 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+
+#include "pmem.h"
+
+enum { allocations = 1000, small_len = 100, class_len = 112, vma_len = 1UL << 20 };
+
+// Thread caches hold at most two batches of 64 blocks per class which are
+// counted as used.
+enum { cache_slack = 128 };
+
+static struct pmem_stats stats = {0};
+
+static size_t class_used(void)
+{
+    for (size_t i = 0; i < pmem_stats_classes; ++i)
+        if (stats.classes[i].len == class_len) return stats.classes[i].used;
+    assert(false);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    assert(pmem_stats);
+    static void *data[allocations] = {0};
+
+    pmem_stats(&stats);
+    size_t used = class_used();
+
+    for (size_t i = 0; i < allocations; ++i) {
+        data[i] = malloc(small_len);
+        memset(data[i], 0xFF, small_len);
+    }
+
+    void *vma = malloc(vma_len);
+    memset(vma, 0xFF, vma_len);
+
+    pmem_stats(&stats);
+    assert(class_used() >= used + allocations);
+    assert(stats.vma_count);
+    assert(stats.vma_bytes >= vma_len);
+    size_t vma_count = stats.vma_count;
+    assert(stats.sources);
+    assert(stats.prof_bytes);
+
+    struct mallinfo2 info = mallinfo2();
+    assert(info.uordblks >= allocations * class_len);
+    assert(info.arena >= info.uordblks);
+    assert(info.hblks == stats.vma_count);
+
+    for (size_t i = 0; i < allocations; ++i) free(data[i]);
+    free(vma);
+
+    pmem_stats(&stats);
+    assert(class_used() <= used + cache_slack);
+    assert(stats.vma_count == vma_count - 1);
+
+    malloc_stats();
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "common.h"
+
+// Not exported so glibc can only name them by their offset in the module.
+__attribute__((noinline)) static void *local_a(size_t len) { return malloc(len); }
+__attribute__((noinline)) static void *local_b(size_t len) { return calloc(1, len); }
+
+// Linked against pmem's objects rather than preloaded as the symbol interning
+// isn't reachable from the public API. qsort and bsearch are exported by libc
+// so every backend should be able to name them.
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    uint64_t first = (uint64_t) &qsort;
+    uint64_t second = (uint64_t) &bsearch;
+
+    uint64_t off_a = 0, off_b = 0, off_c = 0;
+    const char *a = prof_symbol_name(first + 1, &off_a);
+    const char *b = prof_symbol_name(first + 2, &off_b);
+    const char *c = prof_symbol_name(second + 1, &off_c);
+
+    assert(*a);
+    assert(a == b);
+    assert(off_a + 1 == off_b);
+
+    assert(*c);
+    assert(a != c);
+    assert(strcmp(a, c));
+
+    uint64_t off_d = 0, off_e = 0;
+    const char *d = prof_symbol_name((uint64_t) &local_a, &off_d);
+    const char *e = prof_symbol_name((uint64_t) &local_b, &off_e);
+    assert(*d && *e);
+    assert(d != e);
+
+    return 0;
+}
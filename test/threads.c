@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <assert.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define sizeof_arr(arr) (sizeof(arr) / sizeof(arr[0]))
+
+enum { threads = 4, allocations = 10000 };
+
+static const size_t sizes[] = { 8, 16, 100, 512, 1024, 4096 };
+
+
+// -----------------------------------------------------------------------------
+// local
+// -----------------------------------------------------------------------------
+
+// Allocates and frees on the same thread and exits with blocks still cached.
+static void *run_local(void *arg)
+{
+    size_t id = (uintptr_t) arg;
+    static __thread void *data[allocations];
+
+    for (size_t it = 0; it < 5; ++it) {
+        size_t len = sizes[(id + it) % sizeof_arr(sizes)];
+
+        for (size_t i = 0; i < allocations; ++i) {
+            data[i] = malloc(len);
+            memset(data[i], (int) id, len);
+        }
+
+        for (size_t i = 0; i < allocations; ++i) {
+            assert(((uint8_t *) data[i])[len - 1] == (uint8_t) id);
+            free(data[i]);
+        }
+    }
+
+    return NULL;
+}
+
+
+// -----------------------------------------------------------------------------
+// remote
+// -----------------------------------------------------------------------------
+
+// Blocks are allocated by the producer and freed by the consumer through a
+// single-slot mailbox per size.
+static _Atomic(void *) mailbox[sizeof_arr(sizes)];
+
+static void *run_producer(void *arg)
+{
+    (void) arg;
+
+    for (size_t i = 0; i < allocations; ++i) {
+        for (size_t j = 0; j < sizeof_arr(sizes); ++j) {
+            void *ptr = malloc(sizes[j]);
+            *((size_t *) ptr) = i;
+
+            void *exp = NULL;
+            while (!atomic_compare_exchange_weak(&mailbox[j], &exp, ptr)) {
+                exp = NULL;
+                sched_yield();
+            }
+        }
+    }
+
+    return NULL;
+}
+
+static void *run_consumer(void *arg)
+{
+    (void) arg;
+
+    for (size_t i = 0; i < allocations; ++i) {
+        for (size_t j = 0; j < sizeof_arr(sizes); ++j) {
+            void *ptr = NULL;
+            while (!(ptr = atomic_exchange(&mailbox[j], NULL))) sched_yield();
+
+            assert(*((size_t *) ptr) == i);
+            assert(malloc_usable_size(ptr) >= sizes[j]);
+            free(ptr);
+        }
+    }
+
+    return NULL;
+}
+
+
+// -----------------------------------------------------------------------------
+// cross
+// -----------------------------------------------------------------------------
+
+// Blocks are freed from a TLS destructor that runs after the profiler released
+// the thread's stats so the frees reach the source right away while the
+// matching allocations wait in the allocating thread's stats until the next
+// merge. Snapshots must never report more live than was allocated.
+enum { cross_len = 4096, cross_rounds = 100 * 1000 };
+
+static _Atomic(void *) cross_mailbox = NULL;
+static pthread_key_t cross_key;
+
+static void *run_cross_alloc(void *arg)
+{
+    (void) arg;
+
+    for (size_t i = 0; i < cross_rounds; ++i) {
+        void *ptr = malloc(cross_len);
+        memset(ptr, 0, cross_len);
+
+        void *exp = NULL;
+        while (!atomic_compare_exchange_weak(&cross_mailbox, &exp, ptr)) {
+            exp = NULL;
+            sched_yield();
+        }
+    }
+
+    return NULL;
+}
+
+static void cross_free(void *data)
+{
+    (void) data;
+
+    for (size_t i = 0; i < cross_rounds; ++i) {
+        void *ptr = NULL;
+        while (!(ptr = atomic_exchange(&cross_mailbox, NULL))) sched_yield();
+        free(ptr);
+    }
+}
+
+// The key is created after the profiler's which has glibc run its destructor
+// last.
+static void *run_cross_free(void *arg)
+{
+    (void) arg;
+
+    free(malloc(cross_len));
+    pthread_setspecific(cross_key, &cross_key);
+
+    return NULL;
+}
+
+// Only the text format is checked which is the default.
+static void check_cross(void)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "./pmem.%d.log", getpid());
+
+    FILE *file = fopen(path, "r");
+    if (!file) return;
+
+    char line[1024];
+    while (fgets(line, sizeof(line), file)) {
+        size_t live = 0, curr = 0, total = 0;
+        const char *source = strstr(line, "} live:");
+        if (line[0] != '{' || !source) continue;
+
+        int ret = sscanf(source, "} live:%zu, alloc:%zu/%zu", &live, &curr, &total);
+        assert(ret == 3);
+        assert(live <= total);
+    }
+
+    fclose(file);
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    (void) argc, (void) argv;
+
+    pthread_t th[threads];
+
+    for (size_t i = 0; i < threads; ++i)
+        pthread_create(&th[i], NULL, run_local, (void *) i);
+    for (size_t i = 0; i < threads; ++i)
+        pthread_join(th[i], NULL);
+
+    pthread_create(&th[0], NULL, run_producer, NULL);
+    pthread_create(&th[1], NULL, run_consumer, NULL);
+    pthread_join(th[0], NULL);
+    pthread_join(th[1], NULL);
+
+    pthread_key_create(&cross_key, cross_free);
+    pthread_create(&th[0], NULL, run_cross_free, NULL);
+    pthread_create(&th[1], NULL, run_cross_alloc, NULL);
+    pthread_join(th[0], NULL);
+    pthread_join(th[1], NULL);
+
+    run_local((void *) threads);
+    check_cross();
+}
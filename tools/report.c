@@ -0,0 +1,333 @@
+// Decodes the binary snapshots written by pmem with the "bin" PMEM_FORMAT into
+// the text format of pmem.$(pid).log. Snapshots outside of the requested
+// range are skipped without being decoded.
+//
+//   pmem-report <file> [first [last]]
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+// -----------------------------------------------------------------------------
+// state
+// -----------------------------------------------------------------------------
+
+struct symbol
+{
+    const char *name;
+    size_t len;
+    uint64_t off;
+};
+
+struct stack
+{
+    uint64_t hash;
+    size_t len;
+    uint64_t *symbols;
+};
+
+struct reader
+{
+    const uint8_t *it, *end;
+};
+
+static struct { size_t len, cap; struct symbol *data; } symbols = {0};
+static struct { size_t len, cap; struct stack *data; } stacks = {0};
+
+
+// -----------------------------------------------------------------------------
+// utils
+// -----------------------------------------------------------------------------
+
+static void fail(const char *msg)
+{
+    fprintf(stderr, "pmem-report: %s\n", msg);
+    exit(1);
+}
+
+static void *grow(void *data, size_t *cap, size_t len, size_t item)
+{
+    if (len < *cap) return data;
+
+    *cap = *cap ? *cap * 2 : 64;
+    data = realloc(data, *cap * item);
+    if (!data) fail("out of memory");
+    return data;
+}
+
+static bool read_done(struct reader *reader)
+{
+    return reader->it >= reader->end;
+}
+
+static uint64_t read_varint(struct reader *reader)
+{
+    uint64_t value = 0;
+    for (size_t shift = 0; shift < 64; shift += 7) {
+        if (read_done(reader)) fail("truncated varint");
+
+        uint8_t byte = *reader->it++;
+        value |= (uint64_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    fail("invalid varint");
+    return 0;
+}
+
+
+// -----------------------------------------------------------------------------
+// records
+// -----------------------------------------------------------------------------
+
+static void read_symbol(struct reader *reader)
+{
+    if (read_varint(reader) != symbols.len) fail("unexpected symbol id");
+    symbols.data = grow(symbols.data, &symbols.cap, symbols.len, sizeof(*symbols.data));
+
+    struct symbol *symbol = &symbols.data[symbols.len++];
+    symbol->off = read_varint(reader);
+    symbol->name = (const char *) reader->it;
+    symbol->len = reader->end - reader->it;
+}
+
+static void read_stack(struct reader *reader)
+{
+    if (read_varint(reader) != stacks.len) fail("unexpected stack id");
+    stacks.data = grow(stacks.data, &stacks.cap, stacks.len, sizeof(*stacks.data));
+
+    struct stack *stack = &stacks.data[stacks.len++];
+    stack->hash = read_varint(reader);
+    stack->len = read_varint(reader);
+    if (stack->len > (size_t) (reader->end - reader->it)) fail("invalid stack depth");
+
+    stack->symbols = calloc(stack->len, sizeof(*stack->symbols));
+    if (!stack->symbols && stack->len) fail("out of memory");
+
+    for (size_t i = 0; i < stack->len; ++i) {
+        stack->symbols[i] = read_varint(reader);
+        if (stack->symbols[i] >= symbols.len) fail("unknown symbol id");
+    }
+}
+
+// Frees can be merged into a source before their allocations so a snapshot can
+// briefly hold more frees than allocations.
+static inline uint64_t live_sub(uint64_t alloc, uint64_t freed)
+{
+    return alloc > freed ? alloc - freed : 0;
+}
+
+enum { hist_len = 64 };
+
+static inline uint64_t hist_min(uint64_t bucket)
+{
+    return bucket ? 1UL << (bucket - 1) : 0;
+}
+
+static void read_hist(struct reader *reader, uint64_t *hist)
+{
+    memset(hist, 0, sizeof(*hist) * hist_len);
+
+    uint64_t buckets = read_varint(reader);
+    for (size_t i = 0; i < buckets; ++i) {
+        uint64_t bucket = read_varint(reader);
+        if (bucket >= hist_len) fail("invalid histogram bucket");
+        hist[bucket] = read_varint(reader);
+    }
+}
+
+static void print_hist(const uint64_t *hist)
+{
+    for (size_t i = 0; i < hist_len; ++i)
+        if (hist[i]) printf(" %lu:%lu", hist_min(i), hist[i]);
+    printf("\n");
+}
+
+static void print_heap(struct reader *reader)
+{
+    uint64_t rss = read_varint(reader);
+    uint64_t span_len = read_varint(reader);
+    uint64_t vma_mapped = read_varint(reader);
+    uint64_t vma_requested = read_varint(reader);
+    uint64_t vma_cached = read_varint(reader);
+
+    uint64_t classes = read_varint(reader);
+    if (classes > (size_t) (reader->end - reader->it)) fail("invalid class count");
+
+    struct { uint64_t len, spans, used, free; } *class = calloc(classes, sizeof(*class));
+    if (!class && classes) fail("out of memory");
+
+    uint64_t mapped = 0, used = 0, spare = 0;
+    for (size_t i = 0; i < classes; ++i) {
+        class[i].len = read_varint(reader);
+        class[i].spans = read_varint(reader);
+        class[i].used = read_varint(reader);
+        class[i].free = read_varint(reader);
+
+        mapped += class[i].spans * span_len;
+        used += class[i].used * class[i].len;
+        spare += class[i].free * class[i].len;
+    }
+
+    printf("rss=%lu\n", rss);
+    printf("heap: mapped:%lu, used:%lu, free:%lu\n", mapped, used, spare);
+    for (size_t i = 0; i < classes; ++i) {
+        printf("  %lu: mapped:%lu, used:%lu, free:%lu\n",
+                class[i].len, class[i].spans * span_len,
+                class[i].used * class[i].len, class[i].free * class[i].len);
+    }
+    printf("vma: mapped:%lu, requested:%lu, cached:%lu\n", vma_mapped, vma_requested, vma_cached);
+
+    free(class);
+}
+
+static void print_snapshot(struct reader *reader, uint64_t index)
+{
+    uint64_t churn = read_varint(reader);
+    uint64_t thresh = read_varint(reader);
+    uint64_t trigger = read_varint(reader);
+    uint64_t sample = read_varint(reader);
+    uint64_t short_min = read_varint(reader);
+    uint64_t top_n = read_varint(reader);
+    uint64_t top_window = read_varint(reader);
+
+    printf("\n[%3lu]=========================================================\n"
+            "churn=%lu/%lu\n",
+            index, churn, thresh);
+
+    const char *names[] = { "churn", "timer", "signal", "hwm" };
+    bool first = true;
+    printf("trigger=");
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+        if (!(trigger & (1 << i))) continue;
+        printf("%s%s", first ? "" : ",", names[i]);
+        first = false;
+    }
+    printf("\n");
+
+    if (sample) printf("sample=%lu\n", sample);
+    if (top_n) printf("top=%lu/%lu\n", top_n, top_window);
+    print_heap(reader);
+
+    while (!read_done(reader)) {
+        uint64_t id = read_varint(reader);
+        if (id >= stacks.len) fail("unknown stack id");
+        struct stack *stack = &stacks.data[id];
+
+        uint64_t counts[4], bytes[4];
+        for (size_t i = 0; i < 4; ++i) counts[i] = read_varint(reader);
+        for (size_t i = 0; i < 4; ++i) bytes[i] = read_varint(reader);
+
+        printf("\n{%lx} live:%lu, alloc:%lu/%lu, free:%lu/%lu\n",
+                stack->hash, live_sub(bytes[1], bytes[3]), bytes[0], bytes[1], bytes[2], bytes[3]);
+        printf("  calls: live:%lu, alloc:%lu/%lu, free:%lu/%lu\n",
+                live_sub(counts[1], counts[3]), counts[0], counts[1], counts[2], counts[3]);
+
+        uint64_t sizes[hist_len], lifetimes[hist_len];
+        read_hist(reader, sizes);
+        read_hist(reader, lifetimes);
+
+        uint64_t growth = read_varint(reader);
+        if (top_n) printf("  growth:%c%lu\n", growth & 1 ? '-' : '+', (growth + 1) / 2);
+
+        printf("  sizes:");
+        print_hist(sizes);
+
+        if (counts[3]) {
+            uint64_t lived = 0, short_lived = 0;
+            for (size_t i = 0; i < hist_len; ++i) {
+                lived += lifetimes[i];
+                if (hist_min(i) < short_min) short_lived += lifetimes[i];
+            }
+
+            uint64_t ratio = lived ? (short_lived * 100 + lived / 2) / lived : 0;
+            printf("  lifetimes: short:%lu%%, long:%lu%%,", ratio, 100 - ratio);
+            print_hist(lifetimes);
+        }
+
+        for (size_t i = 0; i < stack->len; ++i) {
+            struct symbol *symbol = &symbols.data[stack->symbols[i]];
+            if (!symbol->off)
+                printf("  {%zu} %.*s\n", i, (int) symbol->len, symbol->name);
+            else
+                printf("  {%zu} %.*s+%lu\n", i, (int) symbol->len, symbol->name, symbol->off);
+        }
+    }
+}
+
+
+// -----------------------------------------------------------------------------
+// main
+// -----------------------------------------------------------------------------
+
+static uint64_t parse_index(const char *arg)
+{
+    char *end = NULL;
+    errno = 0;
+    uint64_t value = strtoull(arg, &end, 10);
+    if (errno || !*arg || *end) fail("invalid snapshot index");
+    return value;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s <file> [first [last]]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t first = argc > 2 ? parse_index(argv[2]) : 0;
+    uint64_t last = argc > 3 ? parse_index(argv[3]) : (argc > 2 ? first : UINT64_MAX);
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1) { perror("open"); return 1; }
+
+    struct stat stat = {0};
+    if (fstat(fd, &stat) == -1) { perror("fstat"); return 1; }
+
+    const size_t header_len = 4 + sizeof(uint32_t);
+    if ((size_t) stat.st_size < header_len) fail("not a pmem binary file");
+
+    const uint8_t *data = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) { perror("mmap"); return 1; }
+    close(fd);
+
+    uint32_t version = 0;
+    memcpy(&version, data + 4, sizeof(version));
+    if (memcmp(data, PMEM_BIN_MAGIC, 4)) fail("not a pmem binary file");
+    if (version != pmem_bin_version) fail("unsupported version");
+
+    struct reader file = { .it = data + header_len, .end = data + stat.st_size };
+    while (!read_done(&file)) {
+
+        // The last record might be truncated if the process was writing it when
+        // the file was read.
+        uint8_t type = 0;
+        uint32_t len = 0;
+        if ((size_t) (file.end - file.it) < sizeof(type) + sizeof(len)) break;
+        memcpy(&type, file.it, sizeof(type));
+        memcpy(&len, file.it + sizeof(type), sizeof(len));
+        file.it += sizeof(type) + sizeof(len);
+        if (len > (size_t) (file.end - file.it)) break;
+
+        struct reader record = { .it = file.it, .end = file.it + len };
+        file.it += len;
+
+        switch ((enum pmem_bin_type) type) {
+        case pmem_bin_symbol: { read_symbol(&record); break; }
+        case pmem_bin_stack: { read_stack(&record); break; }
+        case pmem_bin_snapshot: {
+            uint64_t index = read_varint(&record);
+            if (index > last) return 0;
+            if (index >= first) print_snapshot(&record, index);
+            break;
+        }
+        default: { break; }
+        }
+    }
+
+    return 0;
+}